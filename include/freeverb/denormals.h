@@ -10,6 +10,10 @@
 
 #define undenormalise(sample) if(((*(unsigned int*)&sample)&0x7f800000)==0) sample=0.0f
 
+// Branch free alternative for loops that should vectorize:
+// adding and subtracting antidenormal flushes tiny values to zero
+static const float antidenormal = 1e-18f;
+
 #endif//_denormals_
 
 //ends
@@ -0,0 +1,143 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef METHCLA_PLUGINS_BIQUAD_HPP_INCLUDED
+#define METHCLA_PLUGINS_BIQUAD_HPP_INCLUDED
+
+#include <math.h>
+#include <stddef.h>
+
+// Biquad kernel shared by the lpf, hpf and bpf plugins.
+//
+// All channels of a synth share one set of coefficients. The filter state is
+// kept in structure-of-arrays form (x1, x2, y1, y2 for all channels, one
+// after the other) and channels are processed kBiquadLanes at a time, so the
+// per-lane loops map onto a single SIMD register.
+
+static const size_t kBiquadLanes = 4;
+
+static const double kBiquadPi = 3.14159265358979323846264338327950288;
+
+struct BiquadCoeffs
+{
+    float a0, a1, a2, b1, b2;
+};
+
+// 2nd Order Butterworth LowPass
+inline BiquadCoeffs biquad_lpf(float freq, float sampleRate)
+{
+    const double w = 1. / tan(kBiquadPi * freq / sampleRate);
+    const double n = w * w;
+    const double a0 = 1. / (2. + 2. * w + n);
+    BiquadCoeffs c;
+    c.a0 = a0;
+    c.a1 = 2. * a0;
+    c.a2 = a0;
+    c.b1 = 2. * a0 * (1. - n);
+    c.b2 = a0 * (1. - 2. * w + n);
+    return c;
+}
+
+inline BiquadCoeffs biquad_hpf(float freq, float sampleRate)
+{
+    const double w = tan(kBiquadPi * freq / sampleRate);
+    const double n = 1. / (w * w + w + 1.);
+    BiquadCoeffs c;
+    c.a0 = n;
+    c.a1 = -2. * n;
+    c.a2 = n;
+    c.b1 = 2. * n * (w * w - 1.);
+    c.b2 = n * (w * w - w + 1.);
+    return c;
+}
+
+inline BiquadCoeffs biquad_bpf(float freq, float bw, float sampleRate)
+{
+    const double w = 1. / tan(kBiquadPi * bw / sampleRate);
+    const double n = 2. * cos(2. * kBiquadPi * freq / sampleRate);
+    const double a0 = 1. / (1. + w);
+    BiquadCoeffs c;
+    c.a0 = a0;
+    c.a1 = 0.f;
+    c.a2 = -a0;
+    c.b1 = -w * n * a0;
+    c.b2 = a0 * (w - 1.);
+    return c;
+}
+
+// Number of floats of state needed for numChannels channels.
+inline size_t biquad_state_size(size_t numChannels)
+{
+    return 4 * numChannels;
+}
+
+// Process L channels starting at channel ch in lock step.
+template <size_t L>
+inline void biquad_process_lanes( const BiquadCoeffs& c
+                                , float* state
+                                , size_t numChannels
+                                , size_t ch
+                                , float* const* in
+                                , float* const* out
+                                , size_t numFrames )
+{
+    float* sx1 = state + ch;
+    float* sx2 = sx1 + numChannels;
+    float* sy1 = sx2 + numChannels;
+    float* sy2 = sy1 + numChannels;
+
+    float x1[L], x2[L], y1[L], y2[L];
+    for (size_t l = 0; l < L; l++) {
+        x1[l] = sx1[l]; x2[l] = sx2[l];
+        y1[l] = sy1[l]; y2[l] = sy2[l];
+    }
+
+    for (size_t k = 0; k < numFrames; k++) {
+        float x[L], y[L];
+        for (size_t l = 0; l < L; l++) {
+            x[l] = in[ch + l][k];
+        }
+        for (size_t l = 0; l < L; l++) {
+            y[l] = x[l]*c.a0 + x1[l]*c.a1 + x2[l]*c.a2 - y1[l]*c.b1 - y2[l]*c.b2;
+            x2[l] = x1[l]; x1[l] = x[l];
+            y2[l] = y1[l]; y1[l] = y[l];
+        }
+        for (size_t l = 0; l < L; l++) {
+            out[ch + l][k] = y[l];
+        }
+    }
+
+    for (size_t l = 0; l < L; l++) {
+        sx1[l] = x1[l]; sx2[l] = x2[l];
+        sy1[l] = y1[l]; sy2[l] = y2[l];
+    }
+}
+
+inline void biquad_process( const BiquadCoeffs& c
+                          , float* state
+                          , size_t numChannels
+                          , float* const* in
+                          , float* const* out
+                          , size_t numFrames )
+{
+    size_t ch = 0;
+    for (; ch + kBiquadLanes <= numChannels; ch += kBiquadLanes) {
+        biquad_process_lanes<kBiquadLanes>(c, state, numChannels, ch, in, out, numFrames);
+    }
+    for (; ch < numChannels; ch++) {
+        biquad_process_lanes<1>(c, state, numChannels, ch, in, out, numFrames);
+    }
+}
+
+#endif // METHCLA_PLUGINS_BIQUAD_HPP_INCLUDED
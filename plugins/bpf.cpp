@@ -14,12 +14,14 @@
 
 #include <methcla/plugins/bpf.h>
 
+#include <algorithm>
 #include <iostream>
 #include <oscpp/server.hpp>
 #include <unistd.h>
 #include <math.h>
-
-#define PI 3.141592653589793
+#include <string.h>
+#include "biquad.hpp"
+#include "silence.hpp"
 
 typedef enum {
     kBPF_freq,
@@ -31,41 +33,63 @@ typedef enum {
 
 
 // Synth Struct, size of Synth ist dieses Struct
+// With numChannels > 1 the inputs occupy ports kBPF_input_0 .. kBPF_input_0+numChannels-1,
+// followed by the outputs in the same order.
 typedef struct {
-    float* ports[kBPFPorts];
-    double freqmul;
+    float** ports;
+    size_t numChannels;
     size_t samplerate;
-    float del_in[2];
-    float del_out[2];
+    float freq;
+    float bw;
+    BiquadCoeffs coeffs;
+    float* state;
+    SilenceTracker silence;
 } Synth;
 
+struct Options
+{
+    size_t numChannels;
+};
+
 extern "C" {
 
 static bool
-port_descriptor( const Methcla_SynthOptions* /* options */
+port_descriptor( const Methcla_SynthOptions* inOptions
                , Methcla_PortCount index
                , Methcla_PortDescriptor* port )
 {
-    switch ((PortIndex)index) {
-        case kBPF_freq:
-        case kBPF_bw:
-            port->type = kMethcla_ControlPort;
-            port->direction = kMethcla_Input;
-            port->flags = kMethcla_PortFlags;
-            return true;
-        case kBPF_output_0:
-            port->type = kMethcla_AudioPort;
-            port->direction = kMethcla_Output;
-            port->flags = kMethcla_PortFlags;
-            return true;
-        case kBPF_input_0:
-            port->type = kMethcla_AudioPort;
-            port->direction = kMethcla_Input;
-            port->flags = kMethcla_PortFlags;
-            return true;
-        default:
-            return false;
+    const Options* options = (const Options*)inOptions;
+    const size_t numChannels = options->numChannels;
+
+    if (index < kBPF_input_0) {
+        port->type = kMethcla_ControlPort;
+        port->direction = kMethcla_Input;
+        port->flags = kMethcla_PortFlags;
+        return true;
+    }
+    else if (index < kBPF_input_0 + numChannels) {
+        port->type = kMethcla_AudioPort;
+        port->direction = kMethcla_Input;
+        port->flags = kMethcla_PortFlags;
+        return true;
+    }
+    else if (index < kBPF_input_0 + 2 * numChannels) {
+        port->type = kMethcla_AudioPort;
+        port->direction = kMethcla_Output;
+        port->flags = kMethcla_PortFlags;
+        return true;
     }
+    else {
+        return false;
+    }
+}
+
+static void
+configure(const void* tags, size_t tags_size, const void* args, size_t args_size, Methcla_SynthOptions* outOptions)
+{
+    OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
+    Options* options = (Options*)outOptions;
+    options->numChannels = argStream.atEnd() ? 1 : std::max(1, (int)argStream.int32());
 }
 
 static void
@@ -74,13 +98,23 @@ construct( const Methcla_World* world
          , const Methcla_SynthOptions* inOptions
          , Methcla_Synth* synth )
 {
+    const Options* options = (const Options*)inOptions;
     Synth* self = (Synth*)synth;
-    self->samplerate = methcla_world_samplerate(world);    
-    for (int i = 0; i < 2; ++i)
-    {
-        self->del_in[i]=0;
-        self->del_out[i]=0;
+    self->samplerate = methcla_world_samplerate(world);
+    self->numChannels = options->numChannels;
+    self->ports = (float**)methcla_world_alloc(world, (kBPF_input_0 + 2 * self->numChannels) * sizeof(float*));
+
+    const size_t stateSize = biquad_state_size(self->numChannels);
+    self->state = (float*)methcla_world_alloc(world, stateSize * sizeof(float));
+    for (size_t i = 0; i < stateSize; i++) {
+        self->state[i] = 0;
     }
+
+    // Two samples of memory
+    silence_init(&self->silence, 2);
+
+    // Force coefficient computation in the first process call
+    self->freq = -1;
 }
 
 static void
@@ -95,64 +129,56 @@ static void
 process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
 {
     Synth* self = (Synth*)synth;
-    
+
     const float freq = *self->ports[kBPF_freq];
     const float bw = *self->ports[kBPF_bw];
-    float* in = self->ports[kBPF_input_0];
-    float* out = self->ports[kBPF_output_0];
-    int sR = self->samplerate;
-    float n, w, a0, a1, a2, b1, b2;
-
-    for (size_t k = 0; k < numFrames; k++) {
-        
-        w = 1.f / tan ((PI*bw)/sR);
-        
-        n = 2.f * cos ((2.f*PI*freq)/sR);
-        
-        a0 = 1.f / (1.f + w);
-        a1 = 0.f;
-        a2 = -1.f * a0;
-        b1 = -1.f * w * n * a0;
-        b2 = a0 * (w - 1.f);
-        
-        /*
-        w = tan (PI*freq/sR);
-
-        n = 1/(pow(w,2) + w/r + 1);
-
-        a1 = n*w/r;
-        a2 = 0.f;
-        a3 = -a1;
-        b1 = 2*n*(pow(w,2)-1);
-        b2 = n*(pow(w,2) - w/r + 1);
-        */
-        
-        out[k] = self->del_in[0]*a1 + self->del_in[1]*a2 - self->del_out[0]*b1 - self->del_out[1]*b2;
-
-        self->del_out[1] = self->del_out[0];
-        self->del_out[0] = out[k];
-
-        self->del_in[1] = self->del_in[0];
-        self->del_in[0] = in[k];
-
-    }   
+    float* const* in = self->ports + kBPF_input_0;
+    float* const* out = in + self->numChannels;
+
+    // Coefficients are shared by all channels and only recomputed on change
+    if (freq != self->freq || bw != self->bw) {
+        self->coeffs = biquad_bpf(freq, bw, self->samplerate);
+        self->freq = freq;
+        self->bw = bw;
+    }
+
+    const bool inputSilent = silence_check_channels(in, self->numChannels, numFrames);
+    if (silence_skip(&self->silence, inputSilent)) {
+        for (size_t c = 0; c < self->numChannels; c++) {
+            memset(out[c], 0, numFrames * sizeof(float));
+        }
+        return;
+    }
+
+    biquad_process(self->coeffs, self->state, self->numChannels, in, out, numFrames);
+    const bool outputSilent = silence_check_channels(out, self->numChannels, numFrames);
+    if (silence_update(&self->silence, inputSilent, outputSilent, numFrames)) {
+        memset(self->state, 0, biquad_state_size(self->numChannels) * sizeof(float));
+    }
 }
 
 } // extern "C"
 
+static void
+destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    methcla_world_free(world, self->state);
+    methcla_world_free(world, self->ports);
+}
 
 static const Methcla_SynthDef descriptor =
 {
     METHCLA_PLUGINS_BPF_URI,
     sizeof(Synth),
-    0, 
-    NULL,
+    sizeof(Options),
+    configure,
     port_descriptor,
     construct,
     connect,
     NULL,
     process,
-    NULL
+    destroy
 };
 
 static const Methcla_Library library = { NULL, NULL };
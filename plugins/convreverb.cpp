@@ -0,0 +1,511 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <methcla/plugins/convreverb.h>
+
+#include <algorithm>
+#include <iostream>
+#include <oscpp/server.hpp>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include "ffft/FFTReal.h"
+#include "fftconv.hpp"
+
+// Impulse response reverb.
+//
+// Options: path, [headSize (samples, default world block size)],
+//          [maxLength (seconds, default 10)]
+//
+// Ports: wet, dry, latency (control output, seconds), two inputs, two outputs
+//
+// The impulse response is read from the sound file at path, its first
+// channel convolving the left input and its second (or again the first) the
+// right input. It is not resampled. Until it has been loaded the synth passes
+// the dry signal through.
+//
+// The convolution is split in two uniformly partitioned overlap-save stages:
+//
+//   head  partitions of B = headSize samples covering the first 2T samples
+//         of the response; computed every B samples, latency B
+//   tail  partitions of T samples for the rest, with T a power of two near
+//         sqrt(length * B / 2), which balances the cost of both stages
+//
+// A tail period starts when T new input samples are complete. Its work - one
+// forward FFT, the spectral products of all tail partitions and one inverse
+// FFT - is spread over the T/B head cycles of the period, so the audio thread
+// never does more than a slice of it in one block. The result is needed one
+// period later, which is why the tail starts at 2T.
+//
+// Loading, partitioning and transforming the response, as well as allocating
+// the FFT objects and all buffers, happens on the non-realtime side. The wet
+// signal is delayed by B samples, which is reported on the latency port.
+
+static const size_t kConvMaxPath = 256;
+static const size_t kConvMinHeadSize = 16;
+static const float kConvDefaultMaxLength = 10.f;
+
+typedef enum {
+    kConvReverb_wet,
+    kConvReverb_dry,
+    kConvReverb_latency,
+    kConvReverb_input_0,
+    kConvReverb_input_1,
+    kConvReverb_output_0,
+    kConvReverb_output_1,
+    kConvReverbPorts
+} PortIndex;
+
+// Convolution state, allocated as a whole on the non-realtime side
+struct ConvEngine
+{
+    ffft::FFTReal<float>* headFFT;
+    ffft::FFTReal<float>* tailFFT;  // NULL without a tail
+    size_t headSize;                // B
+    size_t tailSize;                // T
+    size_t numHead;
+    size_t numTail;
+    size_t numSlots;                // head cycles per tail period, T/B
+    // Per output channel; the responses are shared for a mono file
+    float* headIR[2];               // numHead spectra of 2B
+    float* tailIR[2];               // numTail spectra of 2T
+    float* headFDL[2];              // input spectra, ring of numHead
+    float* tailFDL[2];              // input spectra, ring of numTail
+    float* headIn[2];               // last two input blocks, 2B
+    float* tailIn[2];               // last two tail periods, 2T
+    float* tailAcc[2];              // spectrum of the tail output being computed
+    float* tailOut[2][2];           // tail output, one played, one computed
+    float* outBuf[2];               // wet output of the last head cycle, B
+    float* spec;                    // scratch, 2B
+    float* time;                    // scratch, max(2B, 2T)
+    size_t headPos;                 // newest entry in headFDL
+    size_t tailPos;                 // newest entry in tailFDL
+    size_t fifoPos;                 // samples of the current block
+    size_t slot;                    // block of the current tail period
+    size_t play;                    // tail output buffer being played
+};
+
+struct ConvRequest
+{
+    Methcla_Synth* synth;   // NULL when cancelled
+    char path[kConvMaxPath];
+    size_t headSize;
+    size_t maxFrames;
+    ConvEngine* engine;
+};
+
+// Synth Struct, size of Synth ist dieses Struct
+typedef struct {
+    float* ports[kConvReverbPorts];
+    ConvRequest* request;
+    ConvEngine* engine;
+    float latency;          // seconds
+} Synth;
+
+struct Options {
+    char path[kConvMaxPath];
+    size_t headSize;
+    float maxLength;
+};
+
+static void
+conv_engine_free(ConvEngine* e)
+{
+    delete e->headFFT;
+    delete e->tailFFT;
+    free(e);
+}
+
+// Partition size for the tail, at least four head blocks
+static size_t
+conv_tail_size(size_t length, size_t headSize)
+{
+    const size_t t = fftconv_next_pow2((size_t)sqrt(0.5 * length * headSize));
+    return std::max(t, 4 * headSize);
+}
+
+// Spectra of numParts partitions of size samples of channel c of the
+// interleaved response, starting at offset, scaled for the inverse FFT
+static void
+conv_transform( ffft::FFTReal<float>* fft, float* spectra, float* time
+              , const float* ir, size_t numChannels, size_t c, size_t length
+              , size_t offset, size_t size, size_t numParts )
+{
+    const float scale = 1.f / (2 * size);
+    for (size_t j = 0; j < numParts; j++) {
+        memset(time, 0, 2 * size * sizeof(float));
+        for (size_t k = 0; k < size; k++) {
+            const size_t i = offset + j * size + k;
+            if (i >= length) break;
+            time[k] = ir[i * numChannels + c] * scale;
+        }
+        fft->do_fft(spectra + j * 2 * size, time);
+    }
+}
+
+static ConvEngine*
+conv_engine_load(const Methcla_Host* host, const char* path, size_t headSize, size_t maxFrames)
+{
+    Methcla_SoundFile* file;
+    Methcla_SoundFileInfo info;
+    if (methcla_host_soundfile_open(host, path, kMethcla_FileModeRead, &file, &info) != kMethcla_NoError) {
+        std::cerr << "convreverb: could not open " << path << std::endl;
+        return NULL;
+    }
+
+    const size_t numChannels = std::max(1u, info.channels);
+    const size_t frames = std::min((size_t)std::max((int64_t)0, info.frames), maxFrames);
+    float* ir = (float*)malloc(std::max((size_t)1, frames * numChannels) * sizeof(float));
+    size_t length = 0;
+    if (ir != NULL && methcla_soundfile_read_float(file, ir, frames, &length) != kMethcla_NoError) {
+        length = 0;
+    }
+    methcla_soundfile_close(file);
+    if (length == 0) {
+        free(ir);
+        return NULL;
+    }
+
+    const size_t numIR = std::min((size_t)2, numChannels);
+    const size_t B = headSize;
+    const size_t T = conv_tail_size(length, B);
+    const size_t numHead = length <= 2 * T ? (length + B - 1) / B : 2 * T / B;
+    const size_t numTail = length <= 2 * T ? 0 : (length - 2 * T + T - 1) / T;
+
+    // Everything after the struct, in floats
+    const size_t irSize = numHead * 2 * B + numTail * 2 * T;
+    const size_t channelSize = numHead * 2 * B + numTail * 2 * T + 2 * B + (numTail > 0 ? 6 * T : 0) + B;
+    const size_t scratchSize = 2 * B + 2 * std::max(B, T);
+    const size_t floats = numIR * irSize + 2 * channelSize + scratchSize;
+
+    ConvEngine* e = (ConvEngine*)calloc(1, sizeof(ConvEngine) + floats * sizeof(float));
+    if (e == NULL) {
+        free(ir);
+        return NULL;
+    }
+    e->headSize = B;
+    e->tailSize = T;
+    e->numHead = numHead;
+    e->numTail = numTail;
+    e->numSlots = T / B;
+    e->headFFT = new ffft::FFTReal<float>(2 * B);
+    e->tailFFT = numTail > 0 ? new ffft::FFTReal<float>(2 * T) : NULL;
+
+    float* mem = (float*)(e + 1);
+    e->spec = mem;
+    mem += 2 * B;
+    e->time = mem;
+    mem += 2 * std::max(B, T);
+    for (size_t c = 0; c < 2; c++) {
+        if (c < numIR) {
+            e->headIR[c] = mem;
+            mem += numHead * 2 * B;
+            e->tailIR[c] = mem;
+            mem += numTail * 2 * T;
+            conv_transform(e->headFFT, e->headIR[c], e->time, ir, numChannels, c, length, 0, B, numHead);
+            if (numTail > 0) {
+                conv_transform(e->tailFFT, e->tailIR[c], e->time, ir, numChannels, c, length, 2 * T, T, numTail);
+            }
+        } else {
+            e->headIR[c] = e->headIR[0];
+            e->tailIR[c] = e->tailIR[0];
+        }
+        e->headFDL[c] = mem;
+        mem += numHead * 2 * B;
+        e->tailFDL[c] = mem;
+        mem += numTail * 2 * T;
+        e->headIn[c] = mem;
+        mem += 2 * B;
+        if (numTail > 0) {
+            e->tailIn[c] = mem;
+            mem += 2 * T;
+            e->tailAcc[c] = mem;
+            mem += 2 * T;
+            e->tailOut[c][0] = mem;
+            mem += T;
+            e->tailOut[c][1] = mem;
+            mem += T;
+        }
+        e->outBuf[c] = mem;
+        mem += B;
+    }
+
+    free(ir);
+    return e;
+}
+
+static void
+conv_host_free(const Methcla_Host* /* host */, void* data)
+{
+    conv_engine_free((ConvEngine*)data);
+}
+
+static void
+conv_world_install(const Methcla_World* world, void* data)
+{
+    ConvRequest* request = (ConvRequest*)data;
+    if (request->synth != NULL) {
+        Synth* self = (Synth*)request->synth;
+        self->request = NULL;
+        self->engine = request->engine;
+    } else if (request->engine != NULL) {
+        methcla_world_perform_command(world, conv_host_free, request->engine);
+    }
+    methcla_world_free(world, request);
+}
+
+static void
+conv_host_load(const Methcla_Host* host, void* data)
+{
+    ConvRequest* request = (ConvRequest*)data;
+    request->engine = conv_engine_load(host, request->path, request->headSize, request->maxFrames);
+    methcla_host_perform_command(host, conv_world_install, request);
+}
+
+// Head stage for the block just completed in headIn
+static void
+conv_head(ConvEngine* e, size_t c)
+{
+    const size_t B = e->headSize;
+    const size_t fftSize = 2 * B;
+    float* fdl = e->headFDL[c];
+    const float* ir = e->headIR[c];
+
+    e->headFFT->do_fft(fdl + e->headPos * fftSize, e->headIn[c]);
+    fftconv_mul(e->spec, fdl + e->headPos * fftSize, ir, fftSize);
+    for (size_t j = 1; j < e->numHead; j++) {
+        const size_t i = (e->headPos + e->numHead - j) % e->numHead;
+        fftconv_mac(e->spec, fdl + i * fftSize, ir + j * fftSize, fftSize);
+    }
+    e->headFFT->do_ifft(e->spec, e->time);
+    // The first half is circularly aliased, the second half is valid
+    memcpy(e->outBuf[c], e->time + B, B * sizeof(float));
+}
+
+// Slice slot of the tail period's work
+static void
+conv_tail(ConvEngine* e, size_t c, size_t slot)
+{
+    const size_t T = e->tailSize;
+    const size_t fftSize = 2 * T;
+    const size_t numMacSlots = e->numSlots - 2;
+
+    if (slot == 0) {
+        e->tailFFT->do_fft(e->tailFDL[c] + e->tailPos * fftSize, e->tailIn[c]);
+        memcpy(e->tailIn[c], e->tailIn[c] + T, T * sizeof(float));
+    } else if (slot <= numMacSlots) {
+        // An even share of the partitions
+        const size_t begin = (slot - 1) * e->numTail / numMacSlots;
+        const size_t end = slot * e->numTail / numMacSlots;
+        for (size_t j = begin; j < end; j++) {
+            const size_t i = (e->tailPos + e->numTail - j) % e->numTail;
+            if (j == 0) fftconv_mul(e->tailAcc[c], e->tailFDL[c] + i * fftSize, e->tailIR[c], fftSize);
+            else fftconv_mac(e->tailAcc[c], e->tailFDL[c] + i * fftSize, e->tailIR[c] + j * fftSize, fftSize);
+        }
+    } else {
+        e->tailFFT->do_ifft(e->tailAcc[c], e->time);
+        memcpy(e->tailOut[c][1 - e->play], e->time + T, T * sizeof(float));
+    }
+}
+
+// Runs once every B input samples
+static void
+conv_cycle(ConvEngine* e)
+{
+    const size_t B = e->headSize;
+    const size_t block = e->slot;
+
+    e->headPos = (e->headPos + 1) % e->numHead;
+    if (e->numTail > 0) {
+        e->slot = (e->slot + 1) % e->numSlots;
+        if (e->slot == 0) e->tailPos = (e->tailPos + 1) % e->numTail;
+        // The first block of a period plays the output finished last period
+        if (e->slot == 1) e->play = 1 - e->play;
+    }
+
+    for (size_t c = 0; c < 2; c++) {
+        conv_head(e, c);
+        if (e->numTail > 0) {
+            memcpy(e->tailIn[c] + e->tailSize + block * B, e->headIn[c] + B, B * sizeof(float));
+            conv_tail(e, c, e->slot);
+            const float* tail = e->tailOut[c][e->play] + block * B;
+            float* out = e->outBuf[c];
+            for (size_t k = 0; k < B; k++) {
+                out[k] += tail[k];
+            }
+        }
+        memcpy(e->headIn[c], e->headIn[c] + B, B * sizeof(float));
+    }
+}
+
+extern "C" {
+
+static bool
+port_descriptor( const Methcla_SynthOptions* /* options */
+               , Methcla_PortCount index
+               , Methcla_PortDescriptor* port )
+{
+    switch ((PortIndex)index) {
+        case kConvReverb_wet:
+        case kConvReverb_dry:
+            port->type = kMethcla_ControlPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kConvReverb_latency:
+            port->type = kMethcla_ControlPort;
+            port->direction = kMethcla_Output;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kConvReverb_input_0:
+        case kConvReverb_input_1:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kConvReverb_output_0:
+        case kConvReverb_output_1:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Output;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void
+configure(const void* tags, size_t tags_size, const void* args, size_t args_size, Methcla_SynthOptions* outOptions)
+{
+    OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
+    Options* options = (Options*)outOptions;
+    strncpy(options->path, argStream.string(), kConvMaxPath - 1);
+    options->path[kConvMaxPath - 1] = '\0';
+    options->headSize = argStream.atEnd() ? 0 : std::max(0, (int)argStream.int32());
+    options->maxLength = argStream.atEnd() ? kConvDefaultMaxLength
+                       : argStream.tag() == 'i' ? argStream.int32() : argStream.float32();
+}
+
+static void
+construct( const Methcla_World* world
+         , const Methcla_SynthDef* /* synthDef */
+         , const Methcla_SynthOptions* inOptions
+         , Methcla_Synth* synth )
+{
+    const Options* options = (const Options*)inOptions;
+    Synth* self = (Synth*)synth;
+
+    const size_t requested = options->headSize > 0 ? options->headSize : methcla_world_block_size(world);
+    const size_t headSize = fftconv_next_pow2(std::max(kConvMinHeadSize, requested));
+    const float samplerate = methcla_world_samplerate(world);
+
+    self->engine = NULL;
+    self->latency = headSize / samplerate;
+
+    ConvRequest* request = (ConvRequest*)methcla_world_alloc(world, sizeof(ConvRequest));
+    self->request = request;
+    if (request != NULL) {
+        request->synth = synth;
+        memcpy(request->path, options->path, kConvMaxPath);
+        request->headSize = headSize;
+        request->maxFrames = std::max(0.f, options->maxLength) * samplerate;
+        request->engine = NULL;
+        methcla_world_perform_command(world, conv_host_load, request);
+    }
+}
+
+static void
+connect( Methcla_Synth* synth
+       , Methcla_PortCount index
+       , void* data )
+{
+    ((Synth*)synth)->ports[index] = (float*)data;
+}
+
+static void
+process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+
+    const float wet = *self->ports[kConvReverb_wet];
+    const float dry = *self->ports[kConvReverb_dry];
+    const float* in[2] = { self->ports[kConvReverb_input_0], self->ports[kConvReverb_input_1] };
+    float* out[2] = { self->ports[kConvReverb_output_0], self->ports[kConvReverb_output_1] };
+    ConvEngine* e = self->engine;
+
+    *self->ports[kConvReverb_latency] = self->latency;
+
+    if (e == NULL) {
+        for (size_t c = 0; c < 2; c++) {
+            for (size_t k = 0; k < numFrames; k++) {
+                out[c][k] = dry * in[c][k];
+            }
+        }
+        return;
+    }
+
+    const size_t B = e->headSize;
+    size_t offset = 0;
+    while (offset < numFrames) {
+        const size_t n = std::min(numFrames - offset, B - e->fifoPos);
+        for (size_t c = 0; c < 2; c++) {
+            const float* x = in[c] + offset;
+            const float* w = e->outBuf[c] + e->fifoPos;
+            float* y = out[c] + offset;
+            memcpy(e->headIn[c] + B + e->fifoPos, x, n * sizeof(float));
+            for (size_t k = 0; k < n; k++) {
+                y[k] = wet * w[k] + dry * x[k];
+            }
+        }
+        e->fifoPos += n;
+        offset += n;
+        if (e->fifoPos == B) {
+            conv_cycle(e);
+            e->fifoPos = 0;
+        }
+    }
+}
+
+} // extern "C"
+
+static void
+destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    if (self->request != NULL) self->request->synth = NULL;
+    if (self->engine != NULL) methcla_world_perform_command(world, conv_host_free, self->engine);
+}
+
+static const Methcla_SynthDef descriptor =
+{
+    METHCLA_PLUGINS_CONVREVERB_URI,
+    sizeof(Synth),
+    sizeof(Options),
+    configure,
+    port_descriptor,
+    construct,
+    connect,
+    NULL,
+    process,
+    destroy
+};
+
+static const Methcla_Library library = { NULL, NULL };
+
+METHCLA_EXPORT const Methcla_Library* methcla_plugins_convreverb(const Methcla_Host* host, const char* /* bundlePath */)
+{
+    methcla_host_register_synthdef(host, &descriptor);
+    return &library;
+}
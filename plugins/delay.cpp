@@ -14,12 +14,15 @@
 
 #include <methcla/plugins/delay.h>
 
+#include <algorithm>
 #include <iostream>
 #include <oscpp/server.hpp>
 #include <unistd.h>
 #include <math.h>
-
-#define PI 3.141592653589793
+#include <string.h>
+#include "delayline.hpp"
+#include "nrtbuffer.hpp"
+#include "silence.hpp"
 
 typedef enum {
     kDel_time,
@@ -29,20 +32,41 @@ typedef enum {
     kDelPorts
 } PortIndex;
 
+// How a change of the delay time is applied:
+//   jump       read head moves at the next block (default)
+//   crossfade  fade from the old to the new read head over kDel_fadeTime
+//   glide      read head slides towards the new time, bending the pitch
+typedef enum {
+    kDel_jump,
+    kDel_crossfade,
+    kDel_glide,
+    kDelModes
+} Mode;
+
+static const float kDel_fadeTime = 0.02f;   // seconds
+static const float kDel_glideTime = 0.1f;   // seconds, time constant
 
 // Synth Struct, size of Synth ist dieses Struct
 typedef struct 
 {
     float* ports[kDelPorts];
-    float* delay;
+    DelayLine delay;
+    NRTBufferRequest* request;
     int sampleRate;
     float maxDelay;
-    int wp;
+    int mode;
+    float delayTime;    // current read head in samples, < 0 before the first block
+    float prevDelay;    // read head faded out during a crossfade
+    float fadeGain;     // gain of the current read head, 1 when not fading
+    float fadeInc;
+    float glideCoef;
+    SilenceTracker silence;
 } Synth;
 
 struct Options
 {
     float maxDelay;
+    int mode;
 };
 
 extern "C" {
@@ -79,7 +103,18 @@ configure(const void* tags, size_t tags_size, const void* args, size_t args_size
 {
     OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
     Options* options = (Options*)outOptions;
-    options->maxDelay = argStream.int32();       
+    // maxDelay in seconds, integer for compatibility with older clients
+    options->maxDelay = argStream.tag() == 'i' ? argStream.int32() : argStream.float32();
+    const int mode = argStream.atEnd() ? kDel_jump : argStream.int32();
+    options->mode = mode >= 0 && mode < kDelModes ? mode : kDel_jump;
+}
+
+static void
+set_buffer(const Methcla_World* world, Methcla_Synth* synth, float* buffer)
+{
+    Synth* self = (Synth*)synth;
+    self->request = NULL;
+    self->delay.buffer = buffer;
 }
 
 static void
@@ -92,16 +127,22 @@ construct( const Methcla_World* world
     Options* options = (Options*)inOptions;
     self->sampleRate = methcla_world_samplerate(world); 
     self->maxDelay = options->maxDelay;
-    self->wp = 0;
-    int maxSamples = ceil(self->maxDelay*self->sampleRate);
+    self->mode = options->mode;
+    self->delayTime = -1.f;
+    self->prevDelay = 0.f;
+    self->fadeGain = 1.f;
+    self->fadeInc = 1.f / (kDel_fadeTime * self->sampleRate);
+    self->glideCoef = 1.f - expf(-1.f / (kDel_glideTime * self->sampleRate));
 
-    float* cDelay = new float[maxSamples];
-        
-    for (int i = 0; i < maxSamples; i++) {
-            cDelay[i] = 0;
-    }
+    const size_t maxSamples = ceil(self->maxDelay*self->sampleRate);
+    const size_t size = delayline_size(maxSamples, methcla_world_block_size(world));
 
-    self->delay = cDelay;
+    // The buffer can be several megabytes; allocate it on the non-realtime
+    // side and output silence until it arrives.
+    delayline_init(&self->delay, NULL, size);
+    self->request = nrtbuffer_request(world, synth, size + 1, set_buffer);
+    // A sample stays in the line for at most its length
+    silence_init(&self->silence, size);
 }
 
 static void
@@ -112,68 +153,138 @@ connect( Methcla_Synth* synth
     ((Synth*)synth)->ports[index] = (float*)data;
 }
 
+// Two read heads while fading, a single one for the rest of the block.
+static void
+process_crossfade(Synth* self, const float* in, float* out, size_t numFrames, float fb)
+{
+    DelayLine* delay = &self->delay;
+    const float vdt = self->delayTime;
+    const float pdt = self->prevDelay;
+    const float inc = self->fadeInc;
+    float g = self->fadeGain;
+    size_t k = 0;
+
+    for (; k < numFrames && g < 1.f; k++) {
+        const float o0 = delayline_read(delay, pdt);
+        const float o1 = delayline_read(delay, vdt);
+        const float o = o0 + g * (o1 - o0);
+        delayline_write(delay, in[k] + o*fb);
+        out[k] = o;
+        g += inc;
+    }
+    for (; k < numFrames; k++) {
+        const float o = delayline_read(delay, vdt);
+        delayline_write(delay, in[k] + o*fb);
+        out[k] = o;
+    }
+
+    self->fadeGain = std::min(g, 1.f);
+}
+
+// Read head follows the target with a one-pole lag.
+static void
+process_glide(Synth* self, const float* in, float* out, size_t numFrames, float target, float fb)
+{
+    DelayLine* delay = &self->delay;
+    const float coef = self->glideCoef;
+    float vdt = self->delayTime;
+
+    for (size_t k = 0; k < numFrames; k++) {
+        vdt += coef * (target - vdt);
+        const float o = delayline_read(delay, vdt);
+        delayline_write(delay, in[k] + o*fb);
+        out[k] = o;
+    }
+
+    // Settle on the target so that the steady state block path takes over
+    self->delayTime = fabsf(target - vdt) < 1e-3f ? target : vdt;
+}
+
 // partially based on the Audio Programming Book by Lazarini
 static void
-process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+process_delay(Synth* self, size_t numFrames)
 {
-    Synth* self = (Synth*)synth;
-    
     const float vdtime = *self->ports[kDel_time];
     const float fb = *self->ports[kDel_fb];
     float* in = self->ports[kDel_input_0];
     float* out = self->ports[kDel_output_0];
-    float* delay = self->delay;
-    int wp = self->wp;
+    DelayLine* delay = &self->delay;
 
+    // calculate current delaytime in samples (float)
+    float vdt = vdtime*self->sampleRate;
 
-    int mdt, rpi;
-    float rp, vdt, frac, next;
+    // calculate max delaytime in samples
+    const float mdt = floorf(self->maxDelay*self->sampleRate);
 
-    // calculate current delaytime in samples (float)
-    vdt = vdtime*self->sampleRate;
+    // delay time is clipped to [1, max delaytime] samples
+    vdt = std::max(1.f, std::min(vdt, mdt));
 
-    // calculate max delaytime in samples (int)
-    mdt = (int) (self->maxDelay*self->sampleRate);
+    if (self->delayTime < 0.f) {
+        self->delayTime = vdt;
+    }
 
-    // if current delay time > max then it gets truncated at max delaytime
-    if(vdt > mdt) vdt = (float) mdt;
+    if (self->mode == kDel_crossfade) {
+        // A change during a fade is picked up when the fade has finished
+        if (self->fadeGain >= 1.f && vdt != self->delayTime) {
+            self->prevDelay = self->delayTime;
+            self->delayTime = vdt;
+            self->fadeGain = 0.f;
+        }
+        if (self->fadeGain < 1.f) {
+            process_crossfade(self, in, out, numFrames, fb);
+            return;
+        }
+    } else if (self->mode == kDel_glide) {
+        if (vdt != self->delayTime) {
+            process_glide(self, in, out, numFrames, vdt, fb);
+            return;
+        }
+    } else {
+        self->delayTime = vdt;
+    }
 
-    // callback loop
-    for (size_t k = 0; k < numFrames; k++) {
+    if (vdt >= numFrames) {
+        // the whole block reads from samples written before this block:
+        // process in contiguous segments
+        delayline_process_block(delay, in, out, numFrames, vdt, fb);
+    } else {
+        // callback loop
+        for (size_t k = 0; k < numFrames; k++) {
+            // read at write pointer position - current delay time position (linear interpolation)
+            const float o = delayline_read(delay, vdt);
+            // copy the input to the delay buffer at the write pointer and advance it
+            delayline_write(delay, in[k] + o*fb);
+            out[k] = o;
+        }
+    }
+}
 
-            // set read pointer to write pointer position - current delay time position
-            rp = wp-vdt;
-
-            // if read pointer equals or is greater than 0, then rp=rp if rp is lesser than maxdelaytime
-            // if rp is greater than maxdelaytime then rp = rp - max dt.
-            // if rp is lesser 0 then rp = rp + mdt;
-
-            rp = (rp >= 0 ? (rp < mdt ? rp : rp - mdt) : rp + mdt);
-            
-            // rpi is casted rp to integer
-            rpi = (int) rp;
-            
-            // calculate the error rest of the cast
-            frac = rp-rpi;
-            
-            // calculate sample if integer cast read pointer unequals max delaytime - 1 then take the following 
-            // sample of the read pointer. if not take sample 0 of delay buffer.
-            next = (rpi != mdt-1 ? delay[rpi+1] : delay[0]);
-            
-            // output sample at read buffer + rest of the next sample (linear interpolation)
-            out[k] = delay[rpi] + frac*(next - delay[rpi]);
-            
-            // copy the input to the delay buffer at index write pointer
-            delay[wp] = in[k] + out[k]*fb;
-                        
-            // advance the write pointer by one, if it's at max delaytime - 1 wrap around.
-            wp = (wp != mdt-1 ? wp+1 : 0);
+static void
+process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+    const float* in = self->ports[kDel_input_0];
+    float* out = self->ports[kDel_output_0];
+
+    const bool inputSilent = silence_check(in, numFrames);
+    if (self->delay.buffer == NULL || silence_skip(&self->silence, inputSilent)) {
+        memset(out, 0, numFrames * sizeof(float));
+        return;
     }
-    self->wp = wp;
+
+    process_delay(self, numFrames);
+    silence_update(&self->silence, inputSilent, silence_check(out, numFrames), numFrames);
 }
 
 } // extern "C"
 
+static void
+destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    nrtbuffer_cancel(self->request);
+    nrtbuffer_free(world, self->delay.buffer);
+}
 
 static const Methcla_SynthDef descriptor =
 {
@@ -186,7 +297,7 @@ static const Methcla_SynthDef descriptor =
     connect,
     NULL,
     process,
-    NULL
+    destroy
 };
 
 static const Methcla_Library library = { NULL, NULL };
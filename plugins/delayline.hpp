@@ -0,0 +1,174 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef METHCLA_PLUGINS_DELAYLINE_HPP_INCLUDED
+#define METHCLA_PLUGINS_DELAYLINE_HPP_INCLUDED
+
+#include <algorithm>
+#include <stddef.h>
+#include <string.h>
+
+// Circular delay buffer with power-of-two size, shared by the delay based
+// plugins.
+//
+// Positions are wrapped with a mask instead of compare-and-branch. The buffer
+// holds one extra guard sample at index size that mirrors index 0, so that
+// block reads with linear interpolation never have to wrap between the two
+// interpolation points.
+//
+// A delay of d samples (d >= 1) reads the sample written d writes ago; the
+// fractional part interpolates linearly towards the next older sample.
+
+struct DelayLine
+{
+    float* buffer;  // size + 1 floats
+    size_t size;
+    size_t mask;
+    size_t wp;
+};
+
+// Buffer size (not counting the guard sample) for delays up to maxDelay
+// samples processed in blocks of up to blockSize samples.
+inline size_t delayline_size(size_t maxDelay, size_t blockSize)
+{
+    size_t size = 1;
+    while (size < maxDelay + blockSize + 2) size <<= 1;
+    return size;
+}
+
+// Attach a zeroed buffer of size + 1 floats.
+inline void delayline_init(DelayLine* d, float* buffer, size_t size)
+{
+    d->buffer = buffer;
+    d->size = size;
+    d->mask = size - 1;
+    d->wp = 0;
+}
+
+// Sample written delay writes ago, linearly interpolated.
+inline float delayline_read(const DelayLine* d, float delay)
+{
+    const size_t di = (size_t)delay;
+    const float frac = delay - di;
+    const float x0 = d->buffer[(d->wp - di) & d->mask];
+    const float x1 = d->buffer[(d->wp - di - 1) & d->mask];
+    return x0 + frac * (x1 - x0);
+}
+
+// Sample written delay writes ago, for integer delays.
+inline float delayline_tap(const DelayLine* d, size_t delay)
+{
+    return d->buffer[(d->wp - delay) & d->mask];
+}
+
+inline void delayline_write(DelayLine* d, float x)
+{
+    d->buffer[d->wp] = x;
+    d->wp = (d->wp + 1) & d->mask;
+}
+
+// Write a block of samples.
+inline void delayline_write_block(DelayLine* d, const float* in, size_t numFrames)
+{
+    while (numFrames > 0) {
+        const size_t n = std::min(numFrames, d->size - d->wp);
+        memcpy(d->buffer + d->wp, in, n * sizeof(float));
+        d->wp = (d->wp + n) & d->mask;
+        in += n;
+        numFrames -= n;
+    }
+    d->buffer[d->size] = d->buffer[0];
+}
+
+// Read the block just written with delayline_write_block, delayed by delay
+// samples (delay >= 1), into out.
+inline void delayline_read_block(const DelayLine* d, float* out, size_t numFrames, float delay)
+{
+    const size_t di = (size_t)delay;
+    const float frac = delay - di;
+    const float* buffer = d->buffer;
+
+    // r points at the older of the two interpolation points
+    size_t r = (d->wp - numFrames - di - 1) & d->mask;
+
+    while (numFrames > 0) {
+        const size_t n = std::min(numFrames, d->size - r);
+        const float* src = buffer + r;
+        if (frac == 0.f) {
+            memcpy(out, src + 1, n * sizeof(float));
+        } else {
+            for (size_t k = 0; k < n; k++) {
+                out[k] = src[k+1] + frac * (src[k] - src[k+1]);
+            }
+        }
+        r = (r + n) & d->mask;
+        out += n;
+        numFrames -= n;
+    }
+}
+
+// out[k] = read(delay); write(in[k] + fb * out[k]) for a whole block.
+//
+// Requires delay >= numFrames, so that all reads refer to samples written in
+// earlier blocks. The block is then split into at most a few contiguous
+// segments; the common case of an integer delay without feedback reduces to
+// two memcpy calls per segment. in and out may be the same buffer.
+inline void delayline_process_block( DelayLine* d
+                                   , const float* in
+                                   , float* out
+                                   , size_t numFrames
+                                   , float delay
+                                   , float fb )
+{
+    const size_t size = d->size;
+    const size_t mask = d->mask;
+    const size_t di = (size_t)delay;
+    const float frac = delay - di;
+    float* buffer = d->buffer;
+
+    buffer[size] = buffer[0];
+
+    // r points at the older of the two interpolation points
+    size_t r = (d->wp - di - 1) & mask;
+    size_t w = d->wp;
+
+    while (numFrames > 0) {
+        const size_t n = std::min(numFrames, std::min(size - r, size - w));
+        const float* src = buffer + r;
+        float* dst = buffer + w;
+
+        if (frac == 0.f && fb == 0.f) {
+            // Read and write regions are disjoint, write first in case in == out
+            memcpy(dst, in, n * sizeof(float));
+            memcpy(out, src + 1, n * sizeof(float));
+        } else {
+            for (size_t k = 0; k < n; k++) {
+                const float o = src[k+1] + frac * (src[k] - src[k+1]);
+                const float x = in[k];
+                out[k] = o;
+                dst[k] = x + fb * o;
+            }
+        }
+
+        r = (r + n) & mask;
+        w = (w + n) & mask;
+        in += n;
+        out += n;
+        numFrames -= n;
+    }
+
+    d->wp = w;
+}
+
+#endif // METHCLA_PLUGINS_DELAYLINE_HPP_INCLUDED
@@ -0,0 +1,487 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <methcla/plugins/earlyref.h>
+
+#include <algorithm>
+#include <iostream>
+#include <oscpp/server.hpp>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include "delayline.hpp"
+#include "nrtbuffer.hpp"
+
+#define PI 3.141592653589793
+
+// Early reflections of a shoebox room, by the image-source method.
+//
+// Options: room width, depth and height (metres), [order (0-4, default 2)]
+//
+// Ports: source x, y, z, listener x, y, z (metres, clamped to the room),
+//        reflect (wall reflection coefficient, 0-1), damp (0-1),
+//        direct (gain of the direct path), mono input, two outputs
+//
+// Every mirror image of the source up to the given number of wall
+// reflections becomes a tap: delayed by its distance to the listener,
+// attenuated by 1/distance (1 at 1 m) and by reflect per reflection, and
+// panned by its direction, with the listener facing +y. Each wall also
+// absorbs high frequencies, which is modelled by one lowpass per reflection
+// order applied to the sum of that order's taps, damp setting the cutoff.
+// Use reverb or fdnreverb for the late tail.
+//
+// The tap set is computed on the non-realtime side whenever the positions
+// or reflect change and crossfaded in over one block when it arrives. All
+// taps are integer delays reading from one shared buffer, so rendering a
+// tap is a contiguous block read mixed into the bus of its order.
+
+static const size_t kERMaxOrder = 4;
+static const size_t kERMaxTaps = 129;           // image sources up to order 4
+static const float kERSpeedOfSound = 343.f;     // m/s
+static const float kERMinRoomSize = 1.f;        // m
+
+typedef enum {
+    kEarlyRef_srcX,
+    kEarlyRef_srcY,
+    kEarlyRef_srcZ,
+    kEarlyRef_lstX,
+    kEarlyRef_lstY,
+    kEarlyRef_lstZ,
+    kEarlyRef_reflect,
+    kEarlyRef_damp,
+    kEarlyRef_direct,
+    kEarlyRef_input_0,
+    kEarlyRef_output_0,
+    kEarlyRef_output_1,
+    kEarlyRefPorts
+} PortIndex;
+
+// Ports the tap set depends on
+static const size_t kERGeometryPorts = kEarlyRef_reflect + 1;
+
+// Taps ordered by reflection order, order n in [orderEnd[n-1], orderEnd[n])
+struct ERTapSet
+{
+    size_t numTaps;
+    size_t orderEnd[kERMaxOrder + 1];
+    size_t delay[kERMaxTaps];   // samples, >= 1
+    float gainL[kERMaxTaps];
+    float gainR[kERMaxTaps];
+};
+
+struct ERRequest
+{
+    Methcla_Synth* synth;   // NULL when cancelled
+    float room[3];
+    float geometry[kERGeometryPorts];
+    size_t order;
+    float samplerate;
+    size_t maxDelay;
+    ERTapSet* taps;
+};
+
+// Synth Struct, size of Synth ist dieses Struct
+typedef struct {
+    float* ports[kEarlyRefPorts];
+    float room[3];
+    size_t order;
+    float samplerate;
+    size_t maxDelay;
+    DelayLine delay;
+    NRTBufferRequest* bufferRequest;
+    ERRequest* request;
+    ERTapSet* taps;         // being played
+    ERTapSet* pending;      // arrived, to be faded in
+    float geometry[kERGeometryPorts];   // last requested, -1 before the first
+    float* bus;             // per order and channel, block size each
+    // Per order lowpass, s += coef * (x - s)
+    float damp;
+    float coef[kERMaxOrder + 1];
+    float state[2][kERMaxOrder + 1];
+} Synth;
+
+struct Options {
+    float room[3];
+    size_t order;
+};
+
+// Coordinate of the image with index n along a wall pair 0 .. size; |n| is
+// the number of reflections
+static float
+er_image(int n, float size, float pos)
+{
+    return n * size + (n & 1 ? size - pos : pos);
+}
+
+static void
+er_add_tap(const ERRequest* request, ERTapSet* taps, int nx, int ny, int nz, size_t order)
+{
+    const float* g = request->geometry;
+    const float dx = er_image(nx, request->room[0], g[kEarlyRef_srcX]) - g[kEarlyRef_lstX];
+    const float dy = er_image(ny, request->room[1], g[kEarlyRef_srcY]) - g[kEarlyRef_lstY];
+    const float dz = er_image(nz, request->room[2], g[kEarlyRef_srcZ]) - g[kEarlyRef_lstZ];
+    const float dist = sqrtf(dx*dx + dy*dy + dz*dz);
+
+    const size_t delay = (size_t)(dist / kERSpeedOfSound * request->samplerate + 0.5f);
+    const float gain = powf(g[kEarlyRef_reflect], order) / std::max(1.f, dist);
+    const float pan = dist > 0.f ? dx / dist : 0.f;
+
+    // equal power panning
+    const float angle = (pan + 1.f) * (PI / 4.);
+    const size_t i = taps->numTaps++;
+    taps->delay[i] = std::max((size_t)1, std::min(delay, request->maxDelay));
+    taps->gainL[i] = gain * cos(angle);
+    taps->gainR[i] = gain * sin(angle);
+}
+
+static ERTapSet*
+er_compute_taps(const ERRequest* request)
+{
+    ERTapSet* taps = (ERTapSet*)malloc(sizeof(ERTapSet));
+    if (taps == NULL) return NULL;
+    taps->numTaps = 0;
+
+    const int order = request->order;
+    for (int n = 0; n <= order; n++) {
+        // All images with |nx| + |ny| + |nz| == n
+        for (int nx = -n; nx <= n; nx++) {
+            const int rx = n - abs(nx);
+            for (int ny = -rx; ny <= rx; ny++) {
+                const int nz = rx - abs(ny);
+                er_add_tap(request, taps, nx, ny, nz, n);
+                if (nz != 0) er_add_tap(request, taps, nx, ny, -nz, n);
+            }
+        }
+        taps->orderEnd[n] = taps->numTaps;
+    }
+
+    return taps;
+}
+
+static void
+er_host_free(const Methcla_Host* /* host */, void* data)
+{
+    free(data);
+}
+
+static void
+er_world_install(const Methcla_World* world, void* data)
+{
+    ERRequest* request = (ERRequest*)data;
+    if (request->synth != NULL) {
+        Synth* self = (Synth*)request->synth;
+        self->request = NULL;
+        // A set that has not been played yet is superseded
+        if (self->pending != NULL) methcla_world_perform_command(world, er_host_free, self->pending);
+        self->pending = request->taps;
+    } else if (request->taps != NULL) {
+        methcla_world_perform_command(world, er_host_free, request->taps);
+    }
+    methcla_world_free(world, request);
+}
+
+static void
+er_host_compute(const Methcla_Host* host, void* data)
+{
+    ERRequest* request = (ERRequest*)data;
+    request->taps = er_compute_taps(request);
+    methcla_host_perform_command(host, er_world_install, request);
+}
+
+// bus[k] += gain * fade(k) * x[k - delay] for both channels, with the fade
+// going linearly from fade0 in steps of fadeInc
+static void
+er_mix_tap( const DelayLine* d, float* busL, float* busR, size_t numFrames
+          , size_t delay, float gainL, float gainR, float fade0, float fadeInc )
+{
+    const float* buffer = d->buffer;
+    size_t r = (d->wp - numFrames - delay) & d->mask;
+
+    while (numFrames > 0) {
+        const size_t n = std::min(numFrames, d->size - r);
+        const float* src = buffer + r;
+        if (fadeInc == 0.f) {
+            for (size_t k = 0; k < n; k++) {
+                busL[k] += gainL * src[k];
+                busR[k] += gainR * src[k];
+            }
+        } else {
+            for (size_t k = 0; k < n; k++) {
+                const float x = (fade0 + k * fadeInc) * src[k];
+                busL[k] += gainL * x;
+                busR[k] += gainR * x;
+            }
+            fade0 += n * fadeInc;
+        }
+        r = (r + n) & d->mask;
+        busL += n;
+        busR += n;
+        numFrames -= n;
+    }
+}
+
+static void
+er_mix_taps( const Synth* self, const ERTapSet* taps, size_t numFrames
+           , float fade0, float fadeInc )
+{
+    size_t i = 0;
+    for (size_t n = 0; n <= self->order; n++) {
+        float* busL = self->bus + 2 * n * numFrames;
+        float* busR = busL + numFrames;
+        for (; i < taps->orderEnd[n]; i++) {
+            er_mix_tap(&self->delay, busL, busR, numFrames, taps->delay[i], taps->gainL[i], taps->gainR[i], fade0, fadeInc);
+        }
+    }
+}
+
+extern "C" {
+
+static bool
+port_descriptor( const Methcla_SynthOptions* /* options */
+               , Methcla_PortCount index
+               , Methcla_PortDescriptor* port )
+{
+    switch ((PortIndex)index) {
+        case kEarlyRef_srcX:
+        case kEarlyRef_srcY:
+        case kEarlyRef_srcZ:
+        case kEarlyRef_lstX:
+        case kEarlyRef_lstY:
+        case kEarlyRef_lstZ:
+        case kEarlyRef_reflect:
+        case kEarlyRef_damp:
+        case kEarlyRef_direct:
+            port->type = kMethcla_ControlPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kEarlyRef_input_0:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kEarlyRef_output_0:
+        case kEarlyRef_output_1:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Output;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void
+configure(const void* tags, size_t tags_size, const void* args, size_t args_size, Methcla_SynthOptions* outOptions)
+{
+    OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
+    Options* options = (Options*)outOptions;
+    for (size_t i = 0; i < 3; i++) {
+        const float size = argStream.tag() == 'i' ? argStream.int32() : argStream.float32();
+        options->room[i] = std::max(kERMinRoomSize, size);
+    }
+    const int order = argStream.atEnd() ? 2 : argStream.int32();
+    options->order = std::min(kERMaxOrder, (size_t)std::max(0, order));
+}
+
+static void
+set_buffer(const Methcla_World* world, Methcla_Synth* synth, float* buffer)
+{
+    Synth* self = (Synth*)synth;
+    self->bufferRequest = NULL;
+    self->delay.buffer = buffer;
+}
+
+static void
+construct( const Methcla_World* world
+         , const Methcla_SynthDef* /* synthDef */
+         , const Methcla_SynthOptions* inOptions
+         , Methcla_Synth* synth )
+{
+    const Options* options = (const Options*)inOptions;
+    Synth* self = (Synth*)synth;
+    const size_t blockSize = methcla_world_block_size(world);
+
+    for (size_t i = 0; i < 3; i++) {
+        self->room[i] = options->room[i];
+    }
+    self->order = options->order;
+    self->samplerate = methcla_world_samplerate(world);
+    self->request = NULL;
+    self->taps = NULL;
+    self->pending = NULL;
+    for (size_t i = 0; i < kERGeometryPorts; i++) {
+        self->geometry[i] = -1;
+    }
+    self->damp = -1;
+    for (size_t n = 0; n <= kERMaxOrder; n++) {
+        self->state[0][n] = 0.f;
+        self->state[1][n] = 0.f;
+    }
+    self->bus = (float*)methcla_world_alloc(world, 2 * (self->order + 1) * blockSize * sizeof(float));
+
+    // No image up to order n is further away than n + 1 room diagonals
+    const float diagonal = sqrtf(self->room[0]*self->room[0] + self->room[1]*self->room[1] + self->room[2]*self->room[2]);
+    self->maxDelay = ceil((self->order + 1) * diagonal / kERSpeedOfSound * self->samplerate);
+
+    const size_t size = delayline_size(self->maxDelay, blockSize);
+    delayline_init(&self->delay, NULL, size);
+    self->bufferRequest = nrtbuffer_request(world, synth, size + 1, set_buffer);
+}
+
+static void
+connect( Methcla_Synth* synth
+       , Methcla_PortCount index
+       , void* data )
+{
+    ((Synth*)synth)->ports[index] = (float*)data;
+}
+
+static void
+request_taps(const Methcla_World* world, Synth* self, const float* geometry)
+{
+    ERRequest* request = (ERRequest*)methcla_world_alloc(world, sizeof(ERRequest));
+    if (request == NULL) return;
+    request->synth = (Methcla_Synth*)self;
+    for (size_t i = 0; i < 3; i++) {
+        request->room[i] = self->room[i];
+    }
+    for (size_t i = 0; i < kERGeometryPorts; i++) {
+        request->geometry[i] = geometry[i];
+        self->geometry[i] = geometry[i];
+    }
+    request->order = self->order;
+    request->samplerate = self->samplerate;
+    request->maxDelay = self->maxDelay;
+    request->taps = NULL;
+    self->request = request;
+    methcla_world_perform_command(world, er_host_compute, request);
+}
+
+static void
+update_filters(Synth* self, float damp)
+{
+    // Per reflection pole, the cutoff falls from Nyquist to about 1.5 kHz
+    const float a = 1.f - 0.8f * std::max(0.f, std::min(damp, 1.f));
+    for (size_t n = 0; n <= self->order; n++) {
+        self->coef[n] = powf(a, n);
+    }
+    self->damp = damp;
+}
+
+static void
+process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+    const float* in = self->ports[kEarlyRef_input_0];
+    float* outL = self->ports[kEarlyRef_output_0];
+    float* outR = self->ports[kEarlyRef_output_1];
+
+    memset(outL, 0, numFrames * sizeof(float));
+    memset(outR, 0, numFrames * sizeof(float));
+
+    if (self->delay.buffer == NULL) return;
+
+    // At most one computation in flight; later changes are picked up when it
+    // has arrived
+    float geometry[kERGeometryPorts];
+    bool changed = false;
+    for (size_t i = 0; i < kERGeometryPorts; i++) {
+        const float x = *self->ports[i];
+        geometry[i] = i == kEarlyRef_reflect ? std::max(0.f, std::min(x, 1.f))
+                                             : std::max(0.f, std::min(x, self->room[i % 3]));
+        changed = changed || geometry[i] != self->geometry[i];
+    }
+    if (changed && self->request == NULL) {
+        request_taps(world, self, geometry);
+    }
+
+    const float damp = *self->ports[kEarlyRef_damp];
+    if (damp != self->damp) {
+        update_filters(self, damp);
+    }
+
+    // Write first, so that taps shorter than a block can read this block
+    delayline_write_block(&self->delay, in, numFrames);
+
+    if (self->taps == NULL && self->pending == NULL) return;
+
+    memset(self->bus, 0, 2 * (self->order + 1) * numFrames * sizeof(float));
+
+    if (self->pending != NULL) {
+        const float step = 1.f / numFrames;
+        if (self->taps != NULL) {
+            er_mix_taps(self, self->taps, numFrames, 1.f - step, -step);
+            methcla_world_perform_command(world, er_host_free, self->taps);
+        }
+        er_mix_taps(self, self->pending, numFrames, step, step);
+        self->taps = self->pending;
+        self->pending = NULL;
+    } else {
+        er_mix_taps(self, self->taps, numFrames, 1.f, 0.f);
+    }
+
+    const float direct = *self->ports[kEarlyRef_direct];
+    for (size_t n = 0; n <= self->order; n++) {
+        const float coef = self->coef[n];
+        const float gain = n == 0 ? direct : 1.f;
+        for (size_t c = 0; c < 2; c++) {
+            const float* bus = self->bus + (2 * n + c) * numFrames;
+            float* out = c == 0 ? outL : outR;
+            float s = self->state[c][n];
+            for (size_t k = 0; k < numFrames; k++) {
+                s += coef * (bus[k] - s);
+                out[k] += gain * s;
+            }
+            self->state[c][n] = s;
+        }
+    }
+}
+
+} // extern "C"
+
+static void
+destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    nrtbuffer_cancel(self->bufferRequest);
+    nrtbuffer_free(world, self->delay.buffer);
+    if (self->request != NULL) self->request->synth = NULL;
+    if (self->taps != NULL) methcla_world_perform_command(world, er_host_free, self->taps);
+    if (self->pending != NULL) methcla_world_perform_command(world, er_host_free, self->pending);
+    methcla_world_free(world, self->bus);
+}
+
+static const Methcla_SynthDef descriptor =
+{
+    METHCLA_PLUGINS_EARLYREF_URI,
+    sizeof(Synth),
+    sizeof(Options),
+    configure,
+    port_descriptor,
+    construct,
+    connect,
+    NULL,
+    process,
+    destroy
+};
+
+static const Methcla_Library library = { NULL, NULL };
+
+METHCLA_EXPORT const Methcla_Library* methcla_plugins_earlyref(const Methcla_Host* host, const char* /* bundlePath */)
+{
+    methcla_host_register_synthdef(host, &descriptor);
+    return &library;
+}
@@ -8,6 +8,8 @@
 
 allpass::allpass()
 {
+	buffer = 0;
+	bufsize = 0;
 	bufidx = 0;
 }
 
@@ -15,6 +17,7 @@ void allpass::setbuffer(float *buf, int size)
 {
 	buffer = buf; 
 	bufsize = size;
+	bufidx = 0;
 }
 
 void allpass::mute()
@@ -14,6 +14,7 @@ public:
 					allpass();
 			void	setbuffer(float *buf, int size);
 	inline  float	process(float inp);
+	inline  void	process(const float *input, float *output, int numsamples);
 			void	mute();
 			void	setfeedback(float val);
 			float	getfeedback();
@@ -43,6 +44,38 @@ inline float allpass::process(float input)
 	return output;
 }
 
+// Block version, in contiguous segments between buffer wraps;
+// input and output may be the same buffer. Within a segment the
+// iterations are independent, so the loop vectorizes.
+
+inline void allpass::process(const float *input, float *output, int numsamples)
+{
+	const float fb = feedback;
+
+	while (numsamples > 0)
+	{
+		int n = bufsize - bufidx;
+		if (n > numsamples) n = numsamples;
+
+		float *buf = buffer + bufidx;
+		for (int k=0; k<n; k++)
+		{
+			float bufout = buf[k];
+			bufout += antidenormal;
+			bufout -= antidenormal;
+			const float in = input[k];
+			buf[k] = in + (bufout*fb);
+			output[k] = -in + bufout;
+		}
+
+		bufidx += n;
+		if (bufidx >= bufsize) bufidx = 0;
+		input += n;
+		output += n;
+		numsamples -= n;
+	}
+}
+
 #endif//_allpass
 
 //ends
\ No newline at end of file
@@ -9,6 +9,8 @@
 comb::comb()
 {
 	filterstore = 0;
+	buffer = 0;
+	bufsize = 0;
 	bufidx = 0;
 }
 
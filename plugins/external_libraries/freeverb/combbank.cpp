@@ -0,0 +1,164 @@
+// Comb filter bank implementation
+//
+// Based on the comb filter written by Jezar at Dreampoint, June 2000
+// http://www.dreampoint.co.uk
+// This code is public domain
+
+#include "combbank.hpp"
+#include "denormals.h"
+
+#include <stdint.h>
+
+// Rows start on a cache line
+static const int rowalign = 64;
+
+// The loops over lanes are marked for complete unrolling, which lets GCC
+// vectorize them at -O2 as well; at -O3 it unrolls them anyway.
+
+// Pairwise sum of the numcombs lanes of one channel
+static inline float sumlanes(const float *o)
+{
+	float h[numcombs];
+#pragma GCC unroll 16
+	for (int j=0; j<numcombs; j++)
+		h[j] = o[j];
+#pragma GCC unroll 4
+	for (int w=numcombs/2; w>0; w/=2)
+#pragma GCC unroll 16
+		for (int j=0; j<w; j++)
+			h[j] += h[j+w];
+	return h[0];
+}
+
+combbank::combbank()
+{
+	ring = 0;
+	numrows = 0;
+	writerow = 0;
+	for (int j=0; j<numlanes; j++)
+	{
+		filterstore[j] = 0;
+		delay[j] = 0;
+	}
+}
+
+int combbank::buffersize(int maxsize)
+{
+	return maxsize*numlanes + rowalign/sizeof(float);
+}
+
+void combbank::setbuffer(float *buf, const int *sizes)
+{
+	const uintptr_t p = ((uintptr_t)buf + rowalign-1) & ~(uintptr_t)(rowalign-1);
+	ring = (float*)p;
+	numrows = 0;
+	for (int j=0; j<numlanes; j++)
+	{
+		delay[j] = sizes[j];
+		if (sizes[j] > numrows) numrows = sizes[j];
+	}
+	writerow = 0;
+}
+
+void combbank::mute()
+{
+	for (int i=0; i<numrows*numlanes; i++)
+		ring[i] = 0;
+	for (int j=0; j<numlanes; j++)
+		filterstore[j] = 0;
+}
+
+void combbank::setdamp(float val)
+{
+	damp1 = val;
+	damp2 = 1-val;
+}
+
+float combbank::getdamp()
+{
+	return damp1;
+}
+
+void combbank::setfeedback(float val)
+{
+	feedback = val;
+}
+
+float combbank::getfeedback()
+{
+	return feedback;
+}
+
+// Rows from writerow on; neither they nor the rows any lane reads wrap
+void combbank::processsegment(const float *input, float *outputL, float *outputR, int numsamples)
+{
+	const float fb = feedback;
+	const float d1 = damp1;
+	const float d2 = damp2;
+	float fs[numlanes];
+	const float *src[numlanes];
+
+	for (int l=0; l<numlanes; l++)
+	{
+		fs[l] = filterstore[l];
+		int r = writerow - delay[l];
+		if (r < 0) r += numrows;
+		src[l] = ring + r*numlanes + l;
+	}
+
+	// With delay[l] == numrows a lane reads the row of this step, before
+	// it is stored
+	float *row = ring + writerow*numlanes;
+	for (int k=0; k<numsamples; k++)
+	{
+		const float in = input[k];
+		float o[numlanes];
+		float w[numlanes];
+#pragma GCC unroll 16
+		for (int l=0; l<numlanes; l++)
+			o[l] = src[l][k*numlanes];
+#pragma GCC unroll 16
+		for (int l=0; l<numlanes; l++)
+		{
+			float f = o[l]*d2 + fs[l]*d1;
+			f += antidenormal;
+			f -= antidenormal;
+			fs[l] = f;
+			w[l] = in + f*fb;
+		}
+#pragma GCC unroll 16
+		for (int l=0; l<numlanes; l++)
+			row[l] = w[l];
+		outputL[k] = sumlanes(o);
+		outputR[k] = sumlanes(o + numcombs);
+		row += numlanes;
+	}
+
+	for (int l=0; l<numlanes; l++)
+		filterstore[l] = fs[l];
+
+	writerow += numsamples;
+	if (writerow >= numrows) writerow = 0;
+}
+
+void combbank::process(const float *input, float *outputL, float *outputR, int numsamples)
+{
+	while (numsamples > 0)
+	{
+		int n = numsamples;
+		if (n > numrows - writerow) n = numrows - writerow;
+		for (int l=0; l<numlanes; l++)
+		{
+			int r = writerow - delay[l];
+			if (r < 0) r += numrows;
+			if (n > numrows - r) n = numrows - r;
+		}
+		processsegment(input, outputL, outputR, n);
+		input += n;
+		outputL += n;
+		outputR += n;
+		numsamples -= n;
+	}
+}
+
+//ends
@@ -0,0 +1,56 @@
+// Comb filter bank declaration
+//
+// Based on the comb filter written by Jezar at Dreampoint, June 2000
+// http://www.dreampoint.co.uk
+// This code is public domain
+
+#ifndef _combbank_
+#define _combbank_
+
+#include "tuning.h"
+
+// All combs of both channels in structure-of-arrays form, lanes 0..numcombs-1
+// feeding the left and numcombs..2*numcombs-1 the right output.
+//
+// The lanes share one ring of rows, one row of numlanes floats (a cache line)
+// per sample. The delay lines are skewed: at time t every lane writes its new
+// value into row t, and lane l reads the value it wrote delay[l] samples ago
+// from row t-delay[l]. A step gathers one float per lane, runs the filter
+// recursions of all lanes with packed operations and stores the whole row at
+// once. The lanes of a channel are added as a pairwise tree, so the output
+// differs from the comb objects added one after the other in the last bits.
+
+class combbank
+{
+public:
+	static const int	numlanes = 2*numcombs;
+	// Samples revmodel passes to process at a time
+	static const int	maxchunk = 128;
+
+					combbank();
+	// Floats of memory for setbuffer with combs of up to maxsize samples
+	static	int		buffersize(int maxsize);
+	// One delay per lane, none longer than the maxsize buf was sized for
+			void	setbuffer(float *buf, const int *sizes);
+			void	process(const float *input, float *outputL, float *outputR, int numsamples);
+			void	mute();
+			void	setdamp(float val);
+			float	getdamp();
+			void	setfeedback(float val);
+			float	getfeedback();
+private:
+			void	processsegment(const float *input, float *outputL, float *outputR, int numsamples);
+private:
+	float	feedback;
+	float	damp1;
+	float	damp2;
+	float	filterstore[numlanes];
+	float	*ring;			// numrows rows of numlanes floats
+	int		numrows;
+	int		writerow;
+	int		delay[numlanes];
+};
+
+#endif //_combbank_
+
+//ends
@@ -6,35 +6,31 @@
 
 #include "revmodel.hpp"
 
-revmodel::revmodel()
+// Reference tunings, scaled to the sample rate by setbuffers
+static const int combtuningL[numcombs] = {
+	combtuningL1, combtuningL2, combtuningL3, combtuningL4,
+	combtuningL5, combtuningL6, combtuningL7, combtuningL8 };
+static const int combtuningR[numcombs] = {
+	combtuningR1, combtuningR2, combtuningR3, combtuningR4,
+	combtuningR5, combtuningR6, combtuningR7, combtuningR8 };
+static const int allpasstuningL[numallpasses] = {
+	allpasstuningL1, allpasstuningL2, allpasstuningL3, allpasstuningL4 };
+static const int allpasstuningR[numallpasses] = {
+	allpasstuningR1, allpasstuningR2, allpasstuningR3, allpasstuningR4 };
+
+static int scaletuning(int size, float samplerate)
 {
-	// Tie the components to their buffers
-	combL[0].setbuffer(bufcombL1,combtuningL1);
-	combR[0].setbuffer(bufcombR1,combtuningR1);
-	combL[1].setbuffer(bufcombL2,combtuningL2);
-	combR[1].setbuffer(bufcombR2,combtuningR2);
-	combL[2].setbuffer(bufcombL3,combtuningL3);
-	combR[2].setbuffer(bufcombR3,combtuningR3);
-	combL[3].setbuffer(bufcombL4,combtuningL4);
-	combR[3].setbuffer(bufcombR4,combtuningR4);
-	combL[4].setbuffer(bufcombL5,combtuningL5);
-	combR[4].setbuffer(bufcombR5,combtuningR5);
-	combL[5].setbuffer(bufcombL6,combtuningL6);
-	combR[5].setbuffer(bufcombR6,combtuningR6);
-	combL[6].setbuffer(bufcombL7,combtuningL7);
-	combR[6].setbuffer(bufcombR7,combtuningR7);
-	combL[7].setbuffer(bufcombL8,combtuningL8);
-	combR[7].setbuffer(bufcombR8,combtuningR8);
-	allpassL[0].setbuffer(bufallpassL1,allpasstuningL1);
-	allpassR[0].setbuffer(bufallpassR1,allpasstuningR1);
-	allpassL[1].setbuffer(bufallpassL2,allpasstuningL2);
-	allpassR[1].setbuffer(bufallpassR2,allpasstuningR2);
-	allpassL[2].setbuffer(bufallpassL3,allpasstuningL3);
-	allpassR[2].setbuffer(bufallpassR3,allpasstuningR3);
-	allpassL[3].setbuffer(bufallpassL4,allpasstuningL4);
-	allpassR[3].setbuffer(bufallpassR4,allpasstuningR4);
+	const int scaled = (int)(size * (samplerate / tuningsamplerate) + 0.5f);
+	return scaled < 1 ? 1 : scaled;
+}
+
+// Samples between comb coefficient steps while smoothing
+static const int glidechunk = 16;
 
+revmodel::revmodel()
+{
 	// Set default values
+	smoothing = false;
 	allpassL[0].setfeedback(0.5f);
 	allpassR[0].setfeedback(0.5f);
 	allpassL[1].setfeedback(0.5f);
@@ -49,9 +45,56 @@ revmodel::revmodel()
 	setdamp(initialdamp);
 	setwidth(initialwidth);
 	setmode(initialmode);
+}
+
+int revmodel::buffersize(float samplerate)
+{
+	int maxcomb = 0;
+	for (int i=0; i<numcombs; i++)
+	{
+		const int sizeL = scaletuning(combtuningL[i],samplerate);
+		const int sizeR = scaletuning(combtuningR[i],samplerate);
+		if (sizeL > maxcomb) maxcomb = sizeL;
+		if (sizeR > maxcomb) maxcomb = sizeR;
+	}
+	int size = combbank::buffersize(maxcomb);
+	for (int i=0; i<numallpasses; i++)
+		size += scaletuning(allpasstuningL[i],samplerate) + scaletuning(allpasstuningR[i],samplerate);
+	return size;
+}
+
+void revmodel::setbuffers(float *buf, float samplerate)
+{
+	// Tie the components to their buffers
+	int combsizes[combbank::numlanes];
+	int maxcomb = 0;
+	for (int i=0; i<numcombs; i++)
+	{
+		combsizes[i] = scaletuning(combtuningL[i],samplerate);
+		combsizes[numcombs+i] = scaletuning(combtuningR[i],samplerate);
+		if (combsizes[i] > maxcomb) maxcomb = combsizes[i];
+		if (combsizes[numcombs+i] > maxcomb) maxcomb = combsizes[numcombs+i];
+	}
+	combs.setbuffer(buf,combsizes);
+	buf += combbank::buffersize(maxcomb);
+	for (int i=0; i<numallpasses; i++)
+	{
+		const int sizeL = scaletuning(allpasstuningL[i],samplerate);
+		const int sizeR = scaletuning(allpasstuningR[i],samplerate);
+		allpassL[i].setbuffer(buf,sizeL);
+		buf += sizeL;
+		allpassR[i].setbuffer(buf,sizeR);
+		buf += sizeR;
+	}
 
-	// Buffer will be full of rubbish - so we MUST mute them
-	mute();
+	// Buffer will be full of rubbish - so we MUST mute them,
+	// even in freeze mode
+	combs.mute();
+	for (int i=0; i<numallpasses; i++)
+	{
+		allpassL[i].mute();
+		allpassR[i].mute();
+	}
 }
 
 void revmodel::mute()
@@ -59,11 +102,7 @@ void revmodel::mute()
 	if (getmode() >= freezemode)
 		return;
 
-	for (int i=0;i<numcombs;i++)
-	{
-		combL[i].mute();
-		combR[i].mute();
-	}
+	combs.mute();
 	for (int i=0;i<numallpasses;i++)
 	{
 		allpassL[i].mute();
@@ -73,80 +112,200 @@ void revmodel::mute()
 
 void revmodel::processreplace(float *inputL, float *inputR, float *outputL, float *outputR, long numsamples, int skip)
 {
-	float outL,outR,input;
-
-	while(numsamples-- > 0)
+	float input[combbank::maxchunk];
+	float combL[combbank::maxchunk];
+	float combR[combbank::maxchunk];
+	float outL,outR;
+
+	// Pending changes, only ever left by smoothing: the combs step
+	// to their new coefficients in short chunks, the gains ramp
+	const long total = numsamples;
+	const float feedback0 = combs.getfeedback();
+	const float damp0 = combs.getdamp();
+	const bool glidecombs = feedback0 != roomsize1 || damp0 != damp1;
+	const bool glidegains = curwet1 != wet1 || curwet2 != wet2 || curdry != dry;
+	const int chunk = glidecombs ? glidechunk : combbank::maxchunk;
+	float gwet1 = curwet1, gwet2 = curwet2, gdry = curdry;
+	const float dwet1 = (wet1-gwet1)/total;
+	const float dwet2 = (wet2-gwet2)/total;
+	const float ddry = (dry-gdry)/total;
+	long done = 0;
+
+	while(numsamples > 0)
 	{
-		outL = outR = 0;
-		input = (*inputL + *inputR) * gain;
+		const int n = numsamples < chunk ? numsamples : chunk;
 
-		// Accumulate comb filters in parallel
-		for(int i=0; i<numcombs; i++)
+		if (glidecombs)
 		{
-			outL += combL[i].process(input);
-			outR += combR[i].process(input);
+			done += n;
+			const float t = (float)done/total;
+			combs.setfeedback(feedback0 + (roomsize1-feedback0)*t);
+			combs.setdamp(damp0 + (damp1-damp0)*t);
 		}
 
+		for(int k=0; k<n; k++)
+			input[k] = (inputL[k*skip] + inputR[k*skip]) * gain;
+
+		// Accumulate comb filters in parallel
+		combs.process(input, combL, combR, n);
+
 		// Feed through allpasses in series
 		for(int i=0; i<numallpasses; i++)
 		{
-			outL = allpassL[i].process(outL);
-			outR = allpassR[i].process(outR);
+			allpassL[i].process(combL, combL, n);
+			allpassR[i].process(combR, combR, n);
 		}
 
-		// Calculate output REPLACING anything already there
-		*outputL = outL*wet1 + outR*wet2 + *inputL*dry;
-		*outputR = outR*wet1 + outL*wet2 + *inputR*dry;
+		if (glidegains)
+		{
+			for(int k=0; k<n; k++)
+			{
+				gwet1 += dwet1;
+				gwet2 += dwet2;
+				gdry += ddry;
+				outL = combL[k];
+				outR = combR[k];
+
+				// Calculate output REPLACING anything already there
+				*outputL = outL*gwet1 + outR*gwet2 + *inputL*gdry;
+				*outputR = outR*gwet1 + outL*gwet2 + *inputR*gdry;
+
+				inputL += skip;
+				inputR += skip;
+				outputL += skip;
+				outputR += skip;
+			}
+		}
+		else
+		{
+			for(int k=0; k<n; k++)
+			{
+				outL = combL[k];
+				outR = combR[k];
+
+				// Calculate output REPLACING anything already there
+				*outputL = outL*wet1 + outR*wet2 + *inputL*dry;
+				*outputR = outR*wet1 + outL*wet2 + *inputR*dry;
+
+				// Increment sample pointers, allowing for interleave (if any)
+				inputL += skip;
+				inputR += skip;
+				outputL += skip;
+				outputR += skip;
+			}
+		}
 
-		// Increment sample pointers, allowing for interleave (if any)
-		inputL += skip;
-		inputR += skip;
-		outputL += skip;
-		outputR += skip;
+		numsamples -= n;
 	}
+
+	// Settle exactly on the targets
+	combs.setfeedback(roomsize1);
+	combs.setdamp(damp1);
+	curwet1 = wet1;
+	curwet2 = wet2;
+	curdry = dry;
 }
 
 void revmodel::processmix(float *inputL, float *inputR, float *outputL, float *outputR, long numsamples, int skip)
 {
-	float outL,outR,input;
-
-	while(numsamples-- > 0)
+	float input[combbank::maxchunk];
+	float combL[combbank::maxchunk];
+	float combR[combbank::maxchunk];
+	float outL,outR;
+
+	// Pending changes, only ever left by smoothing: the combs step
+	// to their new coefficients in short chunks, the gains ramp
+	const long total = numsamples;
+	const float feedback0 = combs.getfeedback();
+	const float damp0 = combs.getdamp();
+	const bool glidecombs = feedback0 != roomsize1 || damp0 != damp1;
+	const bool glidegains = curwet1 != wet1 || curwet2 != wet2 || curdry != dry;
+	const int chunk = glidecombs ? glidechunk : combbank::maxchunk;
+	float gwet1 = curwet1, gwet2 = curwet2, gdry = curdry;
+	const float dwet1 = (wet1-gwet1)/total;
+	const float dwet2 = (wet2-gwet2)/total;
+	const float ddry = (dry-gdry)/total;
+	long done = 0;
+
+	while(numsamples > 0)
 	{
-		outL = outR = 0;
-		input = (*inputL + *inputR) * gain;
+		const int n = numsamples < chunk ? numsamples : chunk;
 
-		// Accumulate comb filters in parallel
-		for(int i=0; i<numcombs; i++)
+		if (glidecombs)
 		{
-			outL += combL[i].process(input);
-			outR += combR[i].process(input);
+			done += n;
+			const float t = (float)done/total;
+			combs.setfeedback(feedback0 + (roomsize1-feedback0)*t);
+			combs.setdamp(damp0 + (damp1-damp0)*t);
 		}
 
+		for(int k=0; k<n; k++)
+			input[k] = (inputL[k*skip] + inputR[k*skip]) * gain;
+
+		// Accumulate comb filters in parallel
+		combs.process(input, combL, combR, n);
+
 		// Feed through allpasses in series
 		for(int i=0; i<numallpasses; i++)
 		{
-			outL = allpassL[i].process(outL);
-			outR = allpassR[i].process(outR);
+			allpassL[i].process(combL, combL, n);
+			allpassR[i].process(combR, combR, n);
 		}
 
-		// Calculate output MIXING with anything already there
-		*outputL += outL*wet1 + outR*wet2 + *inputL*dry;
-		*outputR += outR*wet1 + outL*wet2 + *inputR*dry;
+		if (glidegains)
+		{
+			for(int k=0; k<n; k++)
+			{
+				gwet1 += dwet1;
+				gwet2 += dwet2;
+				gdry += ddry;
+				outL = combL[k];
+				outR = combR[k];
+
+				// Calculate output MIXING with anything already there
+				*outputL += outL*gwet1 + outR*gwet2 + *inputL*gdry;
+				*outputR += outR*gwet1 + outL*gwet2 + *inputR*gdry;
+
+				inputL += skip;
+				inputR += skip;
+				outputL += skip;
+				outputR += skip;
+			}
+		}
+		else
+		{
+			for(int k=0; k<n; k++)
+			{
+				outL = combL[k];
+				outR = combR[k];
+
+				// Calculate output MIXING with anything already there
+				*outputL += outL*wet1 + outR*wet2 + *inputL*dry;
+				*outputR += outR*wet1 + outL*wet2 + *inputR*dry;
+
+				// Increment sample pointers, allowing for interleave (if any)
+				inputL += skip;
+				inputR += skip;
+				outputL += skip;
+				outputR += skip;
+			}
+		}
 
-		// Increment sample pointers, allowing for interleave (if any)
-		inputL += skip;
-		inputR += skip;
-		outputL += skip;
-		outputR += skip;
+		numsamples -= n;
 	}
+
+	// Settle exactly on the targets
+	combs.setfeedback(roomsize1);
+	combs.setdamp(damp1);
+	curwet1 = wet1;
+	curwet2 = wet2;
+	curdry = dry;
 }
 
 void revmodel::update()
 {
 // Recalculate internal values after parameter change
 
-	int i;
-
 	wet1 = wet*(width/2 + 0.5f);
 	wet2 = wet*((1-width)/2);
 
@@ -163,16 +322,13 @@ void revmodel::update()
 		gain = fixedgain;
 	}
 
-	for(int i=0; i<numcombs; i++)
-	{
-		combL[i].setfeedback(roomsize1);
-		combR[i].setfeedback(roomsize1);
-	}
-
-	for(int i=0; i<numcombs; i++)
+	// Smoothing leaves the new values to the next process call
+	if (!smoothing)
 	{
-		combL[i].setdamp(damp1);
-		combR[i].setdamp(damp1);
+		combs.setfeedback(roomsize1);
+		combs.setdamp(damp1);
+		curwet1 = wet1;
+		curwet2 = wet2;
 	}
 }
 
@@ -217,6 +373,8 @@ float revmodel::getwet()
 void revmodel::setdry(float value)
 {
 	dry = value*scaledry;
+	if (!smoothing)
+		curdry = dry;
 }
 
 float revmodel::getdry()
@@ -249,4 +407,14 @@ float revmodel::getmode()
 		return 0;
 }
 
+void revmodel::setsmoothing(bool value)
+{
+	smoothing = value;
+}
+
+bool revmodel::getsmoothing()
+{
+	return smoothing;
+}
+
 //ends
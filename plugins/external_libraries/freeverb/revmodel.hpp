@@ -7,7 +7,7 @@
 #ifndef _revmodel_
 #define _revmodel_
 
-#include "comb.hpp"
+#include "combbank.hpp"
 #include "allpass.hpp"
 #include "tuning.h"
 
@@ -15,6 +15,10 @@ class revmodel
 {
 public:
 					revmodel();
+	// Floats of buffer memory needed at samplerate
+	static	int		buffersize(float samplerate);
+	// Use buffersize(samplerate) floats at buf as delay lines
+			void	setbuffers(float *buf, float samplerate);
 			void	mute();
 			void	processmix(float *inputL, float *inputR, float *outputL, float *outputR, long numsamples, int skip);
 			void	processreplace(float *inputL, float *inputR, float *outputL, float *outputR, long numsamples, int skip);
@@ -30,6 +34,10 @@ public:
 			float	getwidth();
 			void	setmode(float value);
 			float	getmode();
+	// When enabled, settings made between two process calls are reached
+	// gradually across the next call instead of at its first sample
+			void	setsmoothing(bool value);
+			bool	getsmoothing();
 private:
 			void	update();
 private:
@@ -40,46 +48,19 @@ private:
 	float	dry;
 	float	width;
 	float	mode;
+	bool	smoothing;
 
-	// The following are all declared inline 
-	// to remove the need for dynamic allocation
-	// with its subsequent error-checking messiness
+	// Output gains in effect, trailing wet1, wet2 and dry when smoothing
+	float	curwet1,curwet2,curdry;
 
-	// Comb filters
-	comb	combL[numcombs];
-	comb	combR[numcombs];
+	// The delay line memory is provided by setbuffers
+
+	// Comb filters, left and right in one bank
+	combbank	combs;
 
 	// Allpass filters
 	allpass	allpassL[numallpasses];
 	allpass	allpassR[numallpasses];
-
-	// Buffers for the combs
-	float	bufcombL1[combtuningL1];
-	float	bufcombR1[combtuningR1];
-	float	bufcombL2[combtuningL2];
-	float	bufcombR2[combtuningR2];
-	float	bufcombL3[combtuningL3];
-	float	bufcombR3[combtuningR3];
-	float	bufcombL4[combtuningL4];
-	float	bufcombR4[combtuningR4];
-	float	bufcombL5[combtuningL5];
-	float	bufcombR5[combtuningR5];
-	float	bufcombL6[combtuningL6];
-	float	bufcombR6[combtuningR6];
-	float	bufcombL7[combtuningL7];
-	float	bufcombR7[combtuningR7];
-	float	bufcombL8[combtuningL8];
-	float	bufcombR8[combtuningR8];
-
-	// Buffers for the allpasses
-	float	bufallpassL1[allpasstuningL1];
-	float	bufallpassR1[allpasstuningR1];
-	float	bufallpassL2[allpasstuningL2];
-	float	bufallpassR2[allpasstuningR2];
-	float	bufallpassL3[allpasstuningL3];
-	float	bufallpassR3[allpasstuningR3];
-	float	bufallpassL4[allpasstuningL4];
-	float	bufallpassR4[allpasstuningR4];
 };
 
 #endif//_revmodel_
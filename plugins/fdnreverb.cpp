@@ -0,0 +1,446 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <methcla/plugins/fdnreverb.h>
+
+#include <algorithm>
+#include <iostream>
+#include <oscpp/server.hpp>
+#include <unistd.h>
+#include <math.h>
+#include <string.h>
+#include "delayline.hpp"
+#include "nrtbuffer.hpp"
+
+#define TWOPI 6.283185307179586
+
+// Feedback delay network reverb.
+//
+// Options: [numLines (8 or 16, default 8)], [size (0.1-4, default 1)],
+//          [matrix (0: Hadamard (default), 1: Householder)]
+//
+// Ports: decay (T60 in seconds), damp (0-1), mod (0-1), wet, dry,
+//        two inputs, two outputs
+//
+// Each line is a delay with a one-pole absorption filter whose gain gives
+// the line the same T60 at DC; damp shortens the decay towards Nyquist. The
+// filtered line outputs are mixed by an orthogonal matrix, the fast
+// Walsh-Hadamard transform or a Householder reflection, both O(N) per sample
+// rather than N^2, and fed back together with the input. Even lines are
+// driven by and heard on the left, odd lines on the right.
+//
+// The line lengths are mutually prime, spread from 30 to 90 ms at size 1,
+// and each read head is swept by its own slow sine LFO by up to 1 ms (mod)
+// to break up the periodicity of the tail.
+//
+// Processing runs in chunks no longer than the shortest line. All reads of a
+// chunk then refer to samples from earlier chunks, so each line is read into
+// a block, the filters and the mixing matrix run per sample as loops over the
+// lines, and the blocks are written back in one go.
+
+static const size_t kFDNMaxLines = 16;
+static const size_t kFDNChunk = 64;
+static const float kFDNMaxModDepth = 0.001f;    // seconds
+static const float kFDNLFORate = 0.3f;          // Hz, of the first line
+static const float kFDNAntiDenormal = 1e-18f;
+
+// Line lengths at 44.1 kHz and size 1; 8 lines use every other one
+static const float kFDNTuningSampleRate = 44100.f;
+static const int kFDNTuning[kFDNMaxLines] = {
+    1301, 1399, 1511, 1627, 1753, 1889, 2039, 2203,
+    2371, 2551, 2749, 2963, 3191, 3449, 3709, 4001
+};
+
+typedef enum {
+    kFDN_hadamard,
+    kFDN_householder
+} Matrix;
+
+typedef enum {
+    kFDNReverb_decay,
+    kFDNReverb_damp,
+    kFDNReverb_mod,
+    kFDNReverb_wet,
+    kFDNReverb_dry,
+    kFDNReverb_input_0,
+    kFDNReverb_input_1,
+    kFDNReverb_output_0,
+    kFDNReverb_output_1,
+    kFDNReverbPorts
+} PortIndex;
+
+// Synth Struct, size of Synth ist dieses Struct
+typedef struct {
+    float* ports[kFDNReverbPorts];
+    DelayLine lines[kFDNMaxLines];
+    NRTBufferRequest* request;
+    float* buffer;
+    size_t numLines;
+    int matrix;
+    float samplerate;
+    float length[kFDNMaxLines];     // samples, nominal delay
+    float lfoPhase[kFDNMaxLines];   // 0-1
+    float lfoInc[kFDNMaxLines];     // per sample
+    // Control values the filters were computed for
+    float decay;
+    float damp;
+    // Absorption filters: s = coef * x + pole * s
+    float coef[kFDNMaxLines];
+    float pole[kFDNMaxLines];
+    float state[kFDNMaxLines];
+} Synth;
+
+struct Options {
+    size_t numLines;
+    float size;
+    int matrix;
+};
+
+// In place fast Walsh-Hadamard transform, orthonormal
+template <int N>
+static inline void
+mix_hadamard(float* x)
+{
+    for (int h = 1; h < N; h <<= 1) {
+        for (int i = 0; i < N; i += h << 1) {
+            for (int j = i; j < i + h; j++) {
+                const float a = x[j];
+                const float b = x[j+h];
+                x[j] = a + b;
+                x[j+h] = a - b;
+            }
+        }
+    }
+    const float norm = 1.f / sqrtf(N);
+    for (int i = 0; i < N; i++) {
+        x[i] *= norm;
+    }
+}
+
+// In place reflection I - 2/N u u^T with u = (1, ..., 1)
+template <int N>
+static inline void
+mix_householder(float* x)
+{
+    float sum = 0.f;
+    for (int i = 0; i < N; i++) {
+        sum += x[i];
+    }
+    const float d = 2.f * sum / N;
+    for (int i = 0; i < N; i++) {
+        x[i] -= d;
+    }
+}
+
+// Modulated read of n samples, sample k delayed by d0 + k * dd relative to
+// the write position at its own time
+static void
+read_chunk(const DelayLine* line, float* out, size_t n, float d0, float dd)
+{
+    const float* buffer = line->buffer;
+    const size_t mask = line->mask;
+    // Read position in samples, kept positive; interpolation towards the
+    // next newer sample uses the guard sample at index size
+    const float p0 = (float)(line->wp + line->size) - d0;
+    const float step = 1.f - dd;
+    for (size_t k = 0; k < n; k++) {
+        const float p = p0 + k * step;
+        const size_t i = (size_t)(int)p;
+        const float frac = p - (int)p;
+        const float x0 = buffer[i & mask];
+        const float x1 = buffer[(i & mask) + 1];
+        out[k] = x0 + frac * (x1 - x0);
+    }
+}
+
+template <int N, int M>
+static void
+process_chunk(Synth* self, const float* inL, const float* inR, float* outL, float* outR, size_t n, float mod, float wet, float dry)
+{
+    float lineOut[N][kFDNChunk];
+    float lineIn[N][kFDNChunk];
+    float wetL[kFDNChunk];
+    float wetR[kFDNChunk];
+
+    // The LFO is evaluated at the chunk ends and the delay interpolated
+    // linearly in between
+    const float depth = 0.5f * mod * kFDNMaxModDepth * self->samplerate;
+    for (int i = 0; i < N; i++) {
+        const float phase0 = self->lfoPhase[i];
+        float phase1 = phase0 + n * self->lfoInc[i];
+        if (phase1 >= 1.f) phase1 -= 1.f;
+        self->lfoPhase[i] = phase1;
+        const float d0 = self->length[i] + depth * (1.f + sinf(TWOPI * phase0));
+        const float d1 = self->length[i] + depth * (1.f + sinf(TWOPI * phase1));
+        if (d0 == d1) {
+            // Fixed delay, relative to the chunk start
+            delayline_read_block(&self->lines[i], lineOut[i], n, d0 - n);
+        } else {
+            read_chunk(&self->lines[i], lineOut[i], n, d0, (d1 - d0) / n);
+        }
+    }
+
+    float coef[N];
+    float pole[N];
+    float state[N];
+    for (int i = 0; i < N; i++) {
+        coef[i] = self->coef[i];
+        pole[i] = self->pole[i];
+        state[i] = self->state[i];
+    }
+
+    const float outScale = 1.f / sqrtf(0.5f * N);
+    for (size_t k = 0; k < n; k++) {
+        // Absorption
+        float s[N];
+        for (int i = 0; i < N; i++) {
+            s[i] = coef[i] * lineOut[i][k] + pole[i] * state[i];
+            state[i] = s[i];
+        }
+
+        float l = 0.f;
+        float r = 0.f;
+        for (int i = 0; i < N; i += 2) {
+            l += s[i];
+            r += s[i+1];
+        }
+        wetL[k] = l * outScale;
+        wetR[k] = r * outScale;
+
+        if (M == kFDN_householder) mix_householder<N>(s);
+        else mix_hadamard<N>(s);
+
+        // Inputs alternate in sign over pairs of lines
+        const float xl = inL[k] + kFDNAntiDenormal;
+        const float xr = inR[k] + kFDNAntiDenormal;
+        for (int i = 0; i < N; i += 4) {
+            lineIn[i][k] = s[i] + xl;
+            lineIn[i+1][k] = s[i+1] + xr;
+            lineIn[i+2][k] = s[i+2] - xl;
+            lineIn[i+3][k] = s[i+3] - xr;
+        }
+    }
+
+    for (int i = 0; i < N; i++) {
+        self->state[i] = state[i];
+        delayline_write_block(&self->lines[i], lineIn[i], n);
+    }
+
+    for (size_t k = 0; k < n; k++) {
+        outL[k] = wet * wetL[k] + dry * inL[k];
+        outR[k] = wet * wetR[k] + dry * inR[k];
+    }
+}
+
+template <int N, int M>
+static void
+process_lines(Synth* self, const float* inL, const float* inR, float* outL, float* outR, size_t numFrames, float mod, float wet, float dry)
+{
+    for (size_t k = 0; k < numFrames; k += kFDNChunk) {
+        const size_t n = std::min(kFDNChunk, numFrames - k);
+        process_chunk<N,M>(self, inL + k, inR + k, outL + k, outR + k, n, mod, wet, dry);
+    }
+}
+
+extern "C" {
+
+static bool
+port_descriptor( const Methcla_SynthOptions* /* options */
+               , Methcla_PortCount index
+               , Methcla_PortDescriptor* port )
+{
+    switch ((PortIndex)index) {
+        case kFDNReverb_decay:
+        case kFDNReverb_damp:
+        case kFDNReverb_mod:
+        case kFDNReverb_wet:
+        case kFDNReverb_dry:
+            port->type = kMethcla_ControlPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kFDNReverb_input_0:
+        case kFDNReverb_input_1:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kFDNReverb_output_0:
+        case kFDNReverb_output_1:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Output;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void
+configure(const void* tags, size_t tags_size, const void* args, size_t args_size, Methcla_SynthOptions* outOptions)
+{
+    OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
+    Options* options = (Options*)outOptions;
+    const int numLines = argStream.atEnd() ? 8 : argStream.int32();
+    options->numLines = numLines > 8 ? 16 : 8;
+    const float size = argStream.atEnd() ? 1.f
+                     : argStream.tag() == 'i' ? argStream.int32() : argStream.float32();
+    options->size = std::max(0.1f, std::min(size, 4.f));
+    const int matrix = argStream.atEnd() ? kFDN_hadamard : argStream.int32();
+    options->matrix = matrix == kFDN_householder ? kFDN_householder : kFDN_hadamard;
+}
+
+static void
+set_buffer(const Methcla_World* world, Methcla_Synth* synth, float* buffer)
+{
+    Synth* self = (Synth*)synth;
+    self->request = NULL;
+    self->buffer = buffer;
+    if (buffer != NULL) {
+        for (size_t i = 0; i < self->numLines; i++) {
+            self->lines[i].buffer = buffer;
+            buffer += self->lines[i].size + 1;
+        }
+    }
+}
+
+static void
+construct( const Methcla_World* world
+         , const Methcla_SynthDef* /* synthDef */
+         , const Methcla_SynthOptions* inOptions
+         , Methcla_Synth* synth )
+{
+    const Options* options = (const Options*)inOptions;
+    Synth* self = (Synth*)synth;
+
+    self->samplerate = methcla_world_samplerate(world);
+    self->numLines = options->numLines;
+    self->matrix = options->matrix;
+    self->buffer = NULL;
+    self->decay = -1;
+    self->damp = -1;
+
+    const float scale = options->size * self->samplerate / kFDNTuningSampleRate;
+    const float maxMod = ceil(kFDNMaxModDepth * self->samplerate);
+    const size_t step = kFDNMaxLines / self->numLines;
+    size_t total = 0;
+
+    for (size_t i = 0; i < self->numLines; i++) {
+        // Every read of a chunk has to precede the chunk
+        self->length[i] = std::max(floorf(kFDNTuning[i * step] * scale), (float)kFDNChunk + 1.f);
+        self->lfoPhase[i] = (float)i / self->numLines;
+        self->lfoInc[i] = kFDNLFORate * (1.f + 0.13f * i) / self->samplerate;
+        self->state[i] = 0.f;
+        const size_t size = delayline_size(self->length[i] + maxMod, kFDNChunk);
+        delayline_init(&self->lines[i], NULL, size);
+        total += size + 1;
+    }
+
+    self->request = nrtbuffer_request(world, synth, total, set_buffer);
+}
+
+static void
+connect( Methcla_Synth* synth
+       , Methcla_PortCount index
+       , void* data )
+{
+    ((Synth*)synth)->ports[index] = (float*)data;
+}
+
+static void
+update_filters(Synth* self, float decay, float damp)
+{
+    const float t60 = std::max(0.01f, decay);
+    // Ratio of the T60 at Nyquist to the T60 at DC
+    const float alpha = 1.f - 0.75f * std::max(0.f, std::min(damp, 1.f));
+    for (size_t i = 0; i < self->numLines; i++) {
+        // -60 dB after t60 seconds, for this line's delay
+        const float lg = -3.f * self->length[i] / (t60 * self->samplerate);
+        const float g = powf(10.f, lg);
+        const float p = 0.25f * logf(10.f) * lg * (1.f - 1.f / (alpha * alpha));
+        self->pole[i] = std::max(0.f, std::min(p, 0.9f));
+        self->coef[i] = g * (1.f - self->pole[i]);
+    }
+    self->decay = decay;
+    self->damp = damp;
+}
+
+static void
+process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+
+    const float decay = *self->ports[kFDNReverb_decay];
+    const float damp = *self->ports[kFDNReverb_damp];
+    const float mod = std::max(0.f, std::min(*self->ports[kFDNReverb_mod], 1.f));
+    const float wet = *self->ports[kFDNReverb_wet];
+    const float dry = *self->ports[kFDNReverb_dry];
+    const float* inL = self->ports[kFDNReverb_input_0];
+    const float* inR = self->ports[kFDNReverb_input_1];
+    float* outL = self->ports[kFDNReverb_output_0];
+    float* outR = self->ports[kFDNReverb_output_1];
+
+    if (self->buffer == NULL) {
+        // Dry signal only until the delay lines have arrived
+        for (size_t k = 0; k < numFrames; k++) {
+            outL[k] = dry * inL[k];
+            outR[k] = dry * inR[k];
+        }
+        return;
+    }
+
+    if (decay != self->decay || damp != self->damp) {
+        update_filters(self, decay, damp);
+    }
+
+    if (self->numLines == 16) {
+        if (self->matrix == kFDN_householder) process_lines<16,kFDN_householder>(self, inL, inR, outL, outR, numFrames, mod, wet, dry);
+        else process_lines<16,kFDN_hadamard>(self, inL, inR, outL, outR, numFrames, mod, wet, dry);
+    } else {
+        if (self->matrix == kFDN_householder) process_lines<8,kFDN_householder>(self, inL, inR, outL, outR, numFrames, mod, wet, dry);
+        else process_lines<8,kFDN_hadamard>(self, inL, inR, outL, outR, numFrames, mod, wet, dry);
+    }
+}
+
+} // extern "C"
+
+static void
+destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    nrtbuffer_cancel(self->request);
+    nrtbuffer_free(world, self->buffer);
+}
+
+static const Methcla_SynthDef descriptor =
+{
+    METHCLA_PLUGINS_FDNREVERB_URI,
+    sizeof(Synth),
+    sizeof(Options),
+    configure,
+    port_descriptor,
+    construct,
+    connect,
+    NULL,
+    process,
+    destroy
+};
+
+static const Methcla_Library library = { NULL, NULL };
+
+METHCLA_EXPORT const Methcla_Library* methcla_plugins_fdnreverb(const Methcla_Host* host, const char* /* bundlePath */)
+{
+    methcla_host_register_synthdef(host, &descriptor);
+    return &library;
+}
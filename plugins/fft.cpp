@@ -18,12 +18,31 @@
 #include <iostream>
 #include <oscpp/server.hpp>
 #include <oscpp/client.hpp>
+#include <string.h>
 #include <unistd.h>
 #include <math.h>
 #include <vector>
-#include "ffft/FFTReal.h"
+#include "fftconv.hpp"
+#include "fftplan.hpp"
 
-static const double kPi = 3.14159265358979323846264338327950288;
+// Options: fftSize, [window (0: Hann (default), 1: Blackman-Harris, 2: Kaiser)],
+//          [overlap (1 (default), 2 or 4)]
+//
+// Short-time spectrum analysis: every hop = 2 * fftSize / overlap input
+// samples the last 2 * fftSize samples are windowed and transformed, and the
+// fftSize magnitudes are sent to the client as an /fft notification. An
+// overlap of 2 or 4 (50% or 75%) gives smoother spectra over time at the same
+// frequency resolution. The input is collected in a circular buffer, so
+// frames are independent of the block size; a block may complete several
+// frames or none. The first frame is sent once the buffer has filled.
+// fftSize is rounded up to a power of two, at least 2.
+//
+// The FFT object and the window come with a plan built on the non-realtime
+// side; the window is shared by all synths of the same size. The input is
+// passed through until the plan has arrived.
+
+static const size_t kFFTMaxOverlap = 4;
+static const size_t kFFTMinSize = 2;
 
 typedef enum {
     kFFT_input_0,
@@ -35,20 +54,30 @@ typedef enum {
 typedef struct {
     float* ports[kFFTPorts];
     size_t fftSize;
-    size_t fftCycles;
-    size_t fftCurCycle;
+    size_t hopSize;
+    size_t ringPos;         // next write position in ring
+    size_t untilFrame;      // samples until the next frame is due
+    float* ring;            // last fftSize input samples
     float* fftBuf;
     float* sigBuf;    
-    float* win;
+    int window;
+    FFTPlanRequest* request;
+    FFTPlan* plan;
 } Synth;
 
 struct Options {
     size_t fftSize;
+    int window;
+    size_t overlap;
 };
 
-extern "C" {
+// Magnitudes of one frame, passed to the non-realtime side; the values
+// follow the struct
+struct FFTFrame {
+    size_t numItems;
+};
 
-size_t kNumItems;
+extern "C" {
 
 static bool
 port_descriptor( const Methcla_SynthOptions* /* options */
@@ -76,9 +105,23 @@ static void
     {
         OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
         Options* options = (Options*)outOptions;
-        options->fftSize = argStream.int32();       
+        // A power of two >= kFFTMinSize keeps the hop non-zero at any overlap
+        const int fftSize = argStream.int32();
+        options->fftSize = fftconv_next_pow2(fftSize > (int)kFFTMinSize ? fftSize : kFFTMinSize);
+        const int window = argStream.atEnd() ? kFFTWindow_hann : argStream.int32();
+        options->window = window >= 0 && window < kFFTWindows ? window : kFFTWindow_hann;
+        const int overlap = argStream.atEnd() ? 1 : argStream.int32();
+        options->overlap = overlap >= (int)kFFTMaxOverlap ? kFFTMaxOverlap : overlap >= 2 ? 2 : 1;
     }
 
+static void
+set_plan(const Methcla_World* world, Methcla_Synth* synth, FFTPlan* plan)
+{
+    Synth* self = (Synth*)synth;
+    self->request = NULL;
+    self->plan = plan;
+}
+
 static void
 construct( const Methcla_World* world
          , const Methcla_SynthDef* /* synthDef */
@@ -89,18 +132,21 @@ construct( const Methcla_World* world
     
     Options* options = (Options*)inOptions;
     self->fftSize = options->fftSize*2;
+    self->hopSize = self->fftSize / options->overlap;
+    self->ringPos = 0;
+    self->untilFrame = self->fftSize;
     
-    self->fftCycles = (self->fftSize)/ methcla_world_block_size(world);
-    self->fftBuf = (float *)malloc(self->fftSize * sizeof(float));
-    self->win = (float *)malloc(self->fftSize * sizeof(float));
-    self->sigBuf = (float *)malloc(self->fftSize * sizeof(float));
+    self->ring = (float *)methcla_world_alloc(world, self->fftSize * sizeof(float));
+    self->fftBuf = (float *)methcla_world_alloc(world, self->fftSize * sizeof(float));
+    self->sigBuf = (float *)methcla_world_alloc(world, self->fftSize * sizeof(float));
     for (int i=0; i<(int)self->fftSize; i++) {
-        self->win[i]=0.5*(1-cos((2.f*kPi*i)/(self->fftSize-1)));
+        self->ring[i]=0;
         self->fftBuf[i]=0;
         self->sigBuf[i]=0;
     }
-    
-    kNumItems = options->fftSize;
+    self->window = options->window;
+    self->plan = NULL;
+    self->request = fftplan_request(world, synth, self->fftSize, set_plan);
 }
 
 static void
@@ -118,18 +164,16 @@ static void perform_world_free(const Methcla_World* world, void* data)
     
 static void get_fft(const Methcla_Host* host, void* data)
     {
-        float* values = (float*)data;
+        FFTFrame* frame = (FFTFrame*)data;
+        const size_t numItems = frame->numItems;
+        const float* values = (const float*)(frame + 1);
 
-        // Allocate data for OSC packet
-        size_t packetSize = 128 + kNumItems + kNumItems*sizeof(float);
-        void* packetData = methcla_host_alloc(host, packetSize);
-        assert(packetData != nullptr); // TODO: error handling
-        
-        // Construct OSC packet
+        // Construct OSC packet (DynamicPacket owns its storage)
+        size_t packetSize = 128 + numItems + numItems*sizeof(float);
         OSCPP::Client::DynamicPacket packet(packetSize);
         // There's no namespace schema for notifications yet
-        packet.openMessage("/fft",  OSCPP::Tags::array(kNumItems));
-        for (size_t i=0; i < kNumItems; i++) {
+        packet.openMessage("/fft",  OSCPP::Tags::array(numItems));
+        for (size_t i=0; i < numItems; i++) {
             packet.float32(values[i]);
         }
         packet.closeMessage();
@@ -138,76 +182,78 @@ static void get_fft(const Methcla_Host* host, void* data)
         // There's no convenience function yet, trivial to add
         host->notify(host, packet.data(), packet.size());
         
-        // Free packet data (client is required to make a copy)
-        methcla_host_free(host, packetData);
-        
         // Free allocated memory in realtime thread
-        methcla_host_perform_command(host, perform_world_free, values);
+        methcla_host_perform_command(host, perform_world_free, frame);
     }
     
+// Transform the last fftSize samples and send the magnitudes
+static void
+analyze(const Methcla_World* world, Synth* self)
+{
+    const size_t fftSize = self->fftSize;
+    const size_t numItems = fftSize/2;
+    const float* win = self->plan->window[self->window];
+    // Magnitudes of a full scale sine come out as 1, and so does a DC
+    // offset of 1 in bin 0, which has no negative frequency mirror
+    const float scale = 2.f / self->plan->windowSum[self->window];
+    const float scaleDC = 1.f / self->plan->windowSum[self->window];
+
+    // Oldest sample first, in two contiguous pieces
+    const size_t n = fftSize - self->ringPos;
+    for (size_t k = 0; k < n; k++) {
+        self->sigBuf[k] = self->ring[self->ringPos + k] * win[k];
+    }
+    for (size_t k = n; k < fftSize; k++) {
+        self->sigBuf[k] = self->ring[k - n] * win[k];
+    }
+
+    FFTFrame* frame = (FFTFrame*)methcla_world_alloc(world, sizeof(FFTFrame) + numItems * sizeof(float));
+    // Drop the frame when out of memory
+    if (frame == NULL) return;
+    frame->numItems = numItems;
+    float* value = (float*)(frame + 1);
+
+    //do fft
+    self->plan->fft->do_fft(self->fftBuf, self->sigBuf);
+
+    //normalize and correct fft for the window
+    value[0] = fabsf(self->fftBuf[0]) * scaleDC;
+    for (size_t i = 1; i < numItems; ++i)
+    {
+        value[i] = sqrtf(self->fftBuf[i]*self->fftBuf[i] + self->fftBuf[i + numItems]*self->fftBuf[i + numItems]) * scale;
+    }
+
+    methcla_world_perform_command(world, get_fft, frame);
+}
+
 static void
 process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
 {
     Synth* self = (Synth*)synth;
-    size_t kNumItems = self->fftSize/2;
 
     float* in = self->ports[kFFT_input_0];
     float* out = self->ports[kFFT_output_0];
 
-    if (kNumItems < numFrames){
-        for (size_t k = 0; k < kNumItems; k++) {
-            self->sigBuf[k] = in[k] * self->win[k];
-            out[k] = in[k];
-        }
-        
-        ffft::FFTReal<float> fft(self->fftSize);
-        float* value = (float*)methcla_world_alloc(world, kNumItems * sizeof(float));
-        assert(value != nullptr); // TODO: error handling
-        
-        //do fft
-        fft.do_fft(self->fftBuf, self->sigBuf);
-        
-        for (int i = 0; i < kNumItems; ++i)
-        {
-            //normalize and correct fft for hanning window
-            value[i] =  (sqrt(pow(self->fftBuf[i],2) + pow(self->fftBuf[i + self->fftSize/2], 2))) / ((self->fftSize/2)/2);
-        }
-        
-        methcla_world_perform_command(world, get_fft, value);
-        self->fftCurCycle=1;
-        
+    if (self->plan == NULL) {
+        if (out != in) memcpy(out, in, numFrames * sizeof(float));
+        return;
     }
-    
-    else {
-        for (size_t k = 0; k < numFrames; k++) {
-            self->sigBuf[k + numFrames * (self->fftCurCycle-1) ] = in[k] * self->win[k + numFrames * (self->fftCurCycle-1)];
-            //self->sigBuf[k + numFrames* (self->fftCurCycle-1) ] = in[k];
-            out[k] = in[k];
+
+    // Up to the next frame boundary or the end of the ring at a time
+    for (size_t k = 0; k < numFrames; ) {
+        const size_t n = std::min(numFrames - k, std::min(self->untilFrame, self->fftSize - self->ringPos));
+        memcpy(self->ring + self->ringPos, in + k, n * sizeof(float));
+        self->ringPos = (self->ringPos + n) % self->fftSize;
+        self->untilFrame -= n;
+        k += n;
+        if (self->untilFrame == 0) {
+            analyze(world, self);
+            self->untilFrame = self->hopSize;
         }
     }
-        
-    //std::cout  << self->win[fftSize] << std::endl;
-
-    self->fftCurCycle++;
 
-    if(self->fftCurCycle == self->fftCycles){
-        
-        ffft::FFTReal<float> fft(self->fftSize);
-        float* value = (float*)methcla_world_alloc(world, kNumItems * sizeof(float));
-        assert(value != nullptr); // TODO: error handling
-    
-        //do fft
-        fft.do_fft(self->fftBuf, self->sigBuf);
-
-        for (int i = 0; i < kNumItems; ++i)
-        {
-            //normalize and correct fft for hanning window
-            value[i] =  (sqrt(pow(self->fftBuf[i],2) + pow(self->fftBuf[i + self->fftSize/2], 2))) / ((self->fftSize/2)/2);
-        }
-        
-        methcla_world_perform_command(world, get_fft, value);
-        self->fftCurCycle=1;
-    };
+    // in and out may be the same buffer
+    if (out != in) memcpy(out, in, numFrames * sizeof(float));
 }
 
 } // extern "C"
@@ -216,9 +262,11 @@ static void
 destroy(const Methcla_World* world, Methcla_Synth* synth)
 {
     Synth* self = (Synth*)synth;
+    fftplan_cancel(self->request);
+    fftplan_free(world, self->plan);
+    methcla_world_free(world, self->ring);
     methcla_world_free(world, self->fftBuf);
     methcla_world_free(world, self->sigBuf);
-    methcla_world_free(world, self->win);
 }
 
 static const Methcla_SynthDef descriptor =
@@ -232,7 +280,7 @@ static const Methcla_SynthDef descriptor =
     connect,
     NULL,
     process,
-    NULL
+    destroy
 };
 
 static const Methcla_Library library = { NULL, NULL };
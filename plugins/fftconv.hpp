@@ -0,0 +1,75 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef METHCLA_PLUGINS_FFTCONV_HPP_INCLUDED
+#define METHCLA_PLUGINS_FFTCONV_HPP_INCLUDED
+
+#include <stddef.h>
+
+// Helpers for fast convolution with ffft::FFTReal.
+//
+// ffft stores the spectrum of a real signal of length n as
+//   f[0 .. n/2]       real parts of bins 0 .. n/2
+//   f[n/2+1 .. n-1]   negated imaginary parts of bins 1 .. n/2-1
+// The negation cancels out in a complex product, so the usual formula can be
+// applied to the stored values directly. Real and imaginary parts live in two
+// contiguous halves, so the loops below vectorize without shuffles.
+
+// Smallest power of two >= n.
+inline size_t fftconv_next_pow2(size_t n)
+{
+    size_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+// out = a * b
+inline void fftconv_mul(float* out, const float* a, const float* b, size_t fftSize)
+{
+    const size_t half = fftSize / 2;
+    out[0] = a[0] * b[0];
+    out[half] = a[half] * b[half];
+    const float* ar = a;
+    const float* ai = a + half;
+    const float* br = b;
+    const float* bi = b + half;
+    float* outr = out;
+    float* outi = out + half;
+    for (size_t k = 1; k < half; k++) {
+        const float re = ar[k] * br[k] - ai[k] * bi[k];
+        const float im = ar[k] * bi[k] + ai[k] * br[k];
+        outr[k] = re;
+        outi[k] = im;
+    }
+}
+
+// out += a * b, for summing the products of a partitioned convolution
+inline void fftconv_mac(float* out, const float* a, const float* b, size_t fftSize)
+{
+    const size_t half = fftSize / 2;
+    out[0] += a[0] * b[0];
+    out[half] += a[half] * b[half];
+    const float* ar = a;
+    const float* ai = a + half;
+    const float* br = b;
+    const float* bi = b + half;
+    float* outr = out;
+    float* outi = out + half;
+    for (size_t k = 1; k < half; k++) {
+        outr[k] += ar[k] * br[k] - ai[k] * bi[k];
+        outi[k] += ar[k] * bi[k] + ai[k] * br[k];
+    }
+}
+
+#endif // METHCLA_PLUGINS_FFTCONV_HPP_INCLUDED
@@ -0,0 +1,258 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef METHCLA_PLUGINS_FFTPLAN_HPP_INCLUDED
+#define METHCLA_PLUGINS_FFTPLAN_HPP_INCLUDED
+
+#include <methcla/plugin.h>
+
+#include <math.h>
+#include <mutex>
+#include <stdlib.h>
+#include "ffft/FFTReal.h"
+
+// FFT objects and analysis windows, prepared on the non-realtime side.
+//
+// Constructing an ffft::FFTReal allocates and fills its bit reversal and
+// trigonometric tables, and the windows need a cos or Bessel function per
+// sample, so neither belongs on the audio thread. A synth requests a plan in
+// construct and receives it in a world command, like a buffer from
+// nrtbuffer_request.
+//
+// The windows are immutable once built and shared by all plans of the same
+// size through a reference counted cache. The FFTReal is not shared: it
+// transforms through a scratch buffer and, for large sizes, trigonometric
+// oscillators that it keeps inside the object, so every plan owns one and
+// synths processed on different threads never touch each other's state.
+
+typedef enum {
+    kFFTWindow_hann,
+    kFFTWindow_blackmanHarris,
+    kFFTWindow_kaiser,
+    kFFTWindows
+} FFTWindow;
+
+static const double kFFTPlanKaiserBeta = 9.0;
+
+// Shared, read-only after creation
+struct FFTWindowSet
+{
+    size_t size;
+    size_t refCount;
+    float* window[kFFTWindows];     // size floats each, periodic
+    float windowSum[kFFTWindows];   // coherent gain times size
+    FFTWindowSet* next;
+};
+
+// Owned by one synth
+struct FFTPlan
+{
+    size_t size;
+    ffft::FFTReal<float>* fft;
+    const float* window[kFFTWindows];
+    float windowSum[kFFTWindows];
+    FFTWindowSet* windows;
+};
+
+typedef void (*FFTPlanCallback)(const Methcla_World* world, Methcla_Synth* synth, FFTPlan* plan);
+
+struct FFTPlanRequest
+{
+    Methcla_Synth* synth;   // NULL when cancelled
+    FFTPlanCallback callback;
+    size_t size;
+    FFTPlan* plan;
+};
+
+struct FFTWindowCache
+{
+    std::mutex mutex;
+    FFTWindowSet* sets;
+};
+
+// One cache for all plugins
+inline FFTWindowCache& fftplan_window_cache()
+{
+    static FFTWindowCache cache = { {}, NULL };
+    return cache;
+}
+
+// Zeroth order modified Bessel function of the first kind
+inline double fftplan_bessel_i0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 50 && term > 1e-12 * sum; k++) {
+        const double t = x / (2 * k);
+        term *= t * t;
+        sum += term;
+    }
+    return sum;
+}
+
+inline double fftplan_window(FFTWindow w, size_t i, size_t size)
+{
+    const double x = 2. * M_PI * i / size;
+    switch (w) {
+        case kFFTWindow_blackmanHarris:
+            return 0.35875 - 0.48829 * cos(x) + 0.14128 * cos(2 * x) - 0.01168 * cos(3 * x);
+        case kFFTWindow_kaiser: {
+            const double r = 2. * i / size - 1.;
+            return fftplan_bessel_i0(kFFTPlanKaiserBeta * sqrt(1. - r * r)) / fftplan_bessel_i0(kFFTPlanKaiserBeta);
+        }
+        default:
+            return 0.5 * (1. - cos(x));
+    }
+}
+
+inline void fftplan_destroy_windows(FFTWindowSet* set)
+{
+    for (size_t w = 0; w < kFFTWindows; w++) {
+        free(set->window[w]);
+    }
+    free(set);
+}
+
+inline FFTWindowSet* fftplan_create_windows(size_t size)
+{
+    FFTWindowSet* set = (FFTWindowSet*)calloc(1, sizeof(FFTWindowSet));
+    if (set == NULL) return NULL;
+    set->size = size;
+    for (size_t w = 0; w < kFFTWindows; w++) {
+        set->window[w] = (float*)malloc(size * sizeof(float));
+        if (set->window[w] == NULL) {
+            fftplan_destroy_windows(set);
+            return NULL;
+        }
+        double sum = 0.;
+        for (size_t i = 0; i < size; i++) {
+            const double x = fftplan_window((FFTWindow)w, i, size);
+            set->window[w][i] = x;
+            sum += x;
+        }
+        set->windowSum[w] = sum;
+    }
+    return set;
+}
+
+// Non-realtime side: windows for size, shared if they exist
+inline FFTWindowSet* fftplan_acquire_windows(size_t size)
+{
+    FFTWindowCache& cache = fftplan_window_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    FFTWindowSet* set = cache.sets;
+    while (set != NULL && set->size != size) set = set->next;
+    if (set == NULL) {
+        set = fftplan_create_windows(size);
+        if (set == NULL) return NULL;
+        set->next = cache.sets;
+        cache.sets = set;
+    }
+    set->refCount++;
+    return set;
+}
+
+// Non-realtime side: drop a reference, destroying the set with the last one
+inline void fftplan_release_windows(FFTWindowSet* set)
+{
+    FFTWindowCache& cache = fftplan_window_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (--set->refCount > 0) return;
+    FFTWindowSet** p = &cache.sets;
+    while (*p != set) p = &(*p)->next;
+    *p = set->next;
+    fftplan_destroy_windows(set);
+}
+
+// Non-realtime side: a plan with its own FFT object
+inline FFTPlan* fftplan_create(size_t size)
+{
+    FFTPlan* plan = (FFTPlan*)malloc(sizeof(FFTPlan));
+    if (plan == NULL) return NULL;
+    plan->windows = fftplan_acquire_windows(size);
+    if (plan->windows == NULL) {
+        free(plan);
+        return NULL;
+    }
+    plan->size = size;
+    for (size_t w = 0; w < kFFTWindows; w++) {
+        plan->window[w] = plan->windows->window[w];
+        plan->windowSum[w] = plan->windows->windowSum[w];
+    }
+    plan->fft = new ffft::FFTReal<float>(size);
+    return plan;
+}
+
+inline void fftplan_destroy(FFTPlan* plan)
+{
+    delete plan->fft;
+    fftplan_release_windows(plan->windows);
+    free(plan);
+}
+
+static void
+fftplan_host_destroy(const Methcla_Host* /* host */, void* data)
+{
+    fftplan_destroy((FFTPlan*)data);
+}
+
+static void
+fftplan_world_install(const Methcla_World* world, void* data)
+{
+    FFTPlanRequest* request = (FFTPlanRequest*)data;
+    if (request->synth != NULL) {
+        request->callback(world, request->synth, request->plan);
+    } else if (request->plan != NULL) {
+        methcla_world_perform_command(world, fftplan_host_destroy, request->plan);
+    }
+    methcla_world_free(world, request);
+}
+
+static void
+fftplan_host_create(const Methcla_Host* host, void* data)
+{
+    FFTPlanRequest* request = (FFTPlanRequest*)data;
+    request->plan = fftplan_create(request->size);
+    methcla_host_perform_command(host, fftplan_world_install, request);
+}
+
+// Request a plan for size (a power of two). The callback runs in the
+// realtime context and receives NULL if the plan could not be built; the
+// returned request is only valid until then.
+inline FFTPlanRequest*
+fftplan_request(const Methcla_World* world, Methcla_Synth* synth, size_t size, FFTPlanCallback callback)
+{
+    FFTPlanRequest* request = (FFTPlanRequest*)methcla_world_alloc(world, sizeof(FFTPlanRequest));
+    if (request == NULL) return NULL;
+    request->synth = synth;
+    request->callback = callback;
+    request->size = size;
+    request->plan = NULL;
+    methcla_world_perform_command(world, fftplan_host_create, request);
+    return request;
+}
+
+inline void
+fftplan_cancel(FFTPlanRequest* request)
+{
+    if (request != NULL) request->synth = NULL;
+}
+
+inline void
+fftplan_free(const Methcla_World* world, FFTPlan* plan)
+{
+    if (plan != NULL) methcla_world_perform_command(world, fftplan_host_destroy, plan);
+}
+
+#endif // METHCLA_PLUGINS_FFTPLAN_HPP_INCLUDED
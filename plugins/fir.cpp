@@ -0,0 +1,294 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <methcla/plugins/fir.h>
+
+#include <algorithm>
+#include <iostream>
+#include <oscpp/server.hpp>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include "fftconv.hpp"
+#include "fftplan.hpp"
+
+// Options: numTaps (int), numTaps kernel coefficients (float), [fftThreshold (int)]
+//
+// Kernels up to fftThreshold taps are computed in direct form, longer kernels
+// use overlap-save with a partition of nextpow2(numTaps) samples, which is
+// also the latency of that path. Its FFT object is built on the non-realtime
+// side (see fftplan.hpp); the output is silent until it has arrived.
+
+static const size_t kFIRMaxTaps = 1024;
+static const size_t kFIRDefaultFFTThreshold = 128;
+
+typedef enum {
+    kFIR_input_0,
+    kFIR_output_0,
+    kFIRPorts
+} PortIndex;
+
+// Synth Struct, size of Synth ist dieses Struct
+typedef struct {
+    float* ports[kFIRPorts];
+    size_t numTaps;
+    // Direct form
+    float* kernel;      // time-reversed taps
+    float* history;     // numTaps-1 past samples followed by the current block
+    size_t blockSize;
+    // Overlap-save
+    bool useFFT;
+    FFTPlanRequest* request;
+    FFTPlan* plan;
+    size_t partSize;
+    float* kernelSpectrum;
+    float* inBuf;
+    float* specBuf;
+    float* timeBuf;
+    float* outBuf;
+    size_t fifoPos;
+} Synth;
+
+struct Options {
+    size_t numTaps;
+    size_t fftThreshold;
+    float kernel[kFIRMaxTaps];
+};
+
+extern "C" {
+
+static bool
+port_descriptor( const Methcla_SynthOptions* /* options */
+               , Methcla_PortCount index
+               , Methcla_PortDescriptor* port )
+{
+    switch ((PortIndex)index) {
+        case kFIR_input_0:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kFIR_output_0:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Output;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void
+configure(const void* tags, size_t tags_size, const void* args, size_t args_size, Methcla_SynthOptions* outOptions)
+{
+    OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
+    Options* options = (Options*)outOptions;
+    const int numTaps = argStream.int32();
+    options->numTaps = std::min(kFIRMaxTaps, (size_t)std::max(1, numTaps));
+    for (size_t i = 0; i < options->numTaps; i++) {
+        options->kernel[i] = argStream.atEnd() ? 0.f : argStream.float32();
+    }
+    // Skip coefficients beyond kFIRMaxTaps
+    for (int i = options->numTaps; i < numTaps && !argStream.atEnd(); i++) {
+        argStream.drop();
+    }
+    options->fftThreshold = argStream.atEnd() ? kFIRDefaultFFTThreshold : std::max(0, (int)argStream.int32());
+}
+
+static void
+set_plan(const Methcla_World* world, Methcla_Synth* synth, FFTPlan* plan)
+{
+    Synth* self = (Synth*)synth;
+    self->request = NULL;
+    self->plan = plan;
+    if (plan != NULL) {
+        plan->fft->do_fft(self->kernelSpectrum, self->timeBuf);
+    }
+}
+
+static void
+construct( const Methcla_World* world
+         , const Methcla_SynthDef* /* synthDef */
+         , const Methcla_SynthOptions* inOptions
+         , Methcla_Synth* synth )
+{
+    const Options* options = (const Options*)inOptions;
+    Synth* self = (Synth*)synth;
+    const size_t numTaps = options->numTaps;
+
+    self->numTaps = numTaps;
+    self->kernel = NULL;
+    self->history = NULL;
+    self->useFFT = numTaps > options->fftThreshold;
+    self->request = NULL;
+    self->plan = NULL;
+
+    if (!self->useFFT) {
+        self->blockSize = methcla_world_block_size(world);
+        self->kernel = (float*)methcla_world_alloc(world, numTaps * sizeof(float));
+        for (size_t i = 0; i < numTaps; i++) {
+            self->kernel[i] = options->kernel[numTaps - 1 - i];
+        }
+        const size_t historySize = numTaps - 1 + self->blockSize;
+        self->history = (float*)methcla_world_alloc(world, historySize * sizeof(float));
+        memset(self->history, 0, historySize * sizeof(float));
+    } else {
+        const size_t partSize = fftconv_next_pow2(numTaps);
+        const size_t fftSize = 2 * partSize;
+        self->partSize = partSize;
+        self->fifoPos = 0;
+
+        float* mem = (float*)methcla_world_alloc(world, (4 * fftSize + partSize) * sizeof(float));
+        self->kernelSpectrum = mem;
+        self->inBuf = mem + fftSize;
+        self->specBuf = mem + 2 * fftSize;
+        self->timeBuf = mem + 3 * fftSize;
+        self->outBuf = mem + 4 * fftSize;
+        memset(self->inBuf, 0, fftSize * sizeof(float));
+        memset(self->outBuf, 0, partSize * sizeof(float));
+
+        // Kernel with the IFFT scaling folded in, transformed in set_plan
+        memset(self->timeBuf, 0, fftSize * sizeof(float));
+        for (size_t i = 0; i < numTaps; i++) {
+            self->timeBuf[i] = options->kernel[i] / fftSize;
+        }
+        self->request = fftplan_request(world, synth, fftSize, set_plan);
+    }
+}
+
+static void
+connect( Methcla_Synth* synth
+       , Methcla_PortCount index
+       , void* data )
+{
+    ((Synth*)synth)->ports[index] = (float*)data;
+}
+
+static inline float
+dot(const float* a, const float* b, size_t n)
+{
+    // Four independent accumulators to break the dependency chain
+    float acc0 = 0.f, acc1 = 0.f, acc2 = 0.f, acc3 = 0.f;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 += a[i]   * b[i];
+        acc1 += a[i+1] * b[i+1];
+        acc2 += a[i+2] * b[i+2];
+        acc3 += a[i+3] * b[i+3];
+    }
+    float sum = (acc0 + acc1) + (acc2 + acc3);
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static void
+process_direct(Synth* self, const float* in, float* out, size_t numFrames)
+{
+    const size_t numTaps = self->numTaps;
+    float* history = self->history;
+
+    // The current block is appended to the last numTaps-1 samples, so each
+    // output is a dot product over a contiguous window of the history.
+    memcpy(history + numTaps - 1, in, numFrames * sizeof(float));
+    for (size_t k = 0; k < numFrames; k++) {
+        out[k] = dot(self->kernel, history + k, numTaps);
+    }
+    memmove(history, history + numFrames, (numTaps - 1) * sizeof(float));
+}
+
+static void
+process_fft(Synth* self, const float* in, float* out, size_t numFrames)
+{
+    const size_t partSize = self->partSize;
+    const size_t fftSize = 2 * partSize;
+    const ffft::FFTReal<float>* fft = self->plan->fft;
+
+    while (numFrames > 0) {
+        const size_t n = std::min(numFrames, partSize - self->fifoPos);
+
+        memcpy(self->inBuf + partSize + self->fifoPos, in, n * sizeof(float));
+        memcpy(out, self->outBuf + self->fifoPos, n * sizeof(float));
+        self->fifoPos += n;
+        in += n;
+        out += n;
+        numFrames -= n;
+
+        if (self->fifoPos == partSize) {
+            fft->do_fft(self->specBuf, self->inBuf);
+            fftconv_mul(self->specBuf, self->specBuf, self->kernelSpectrum, fftSize);
+            fft->do_ifft(self->specBuf, self->timeBuf);
+            // The first half is circularly aliased, the second half is valid
+            memcpy(self->outBuf, self->timeBuf + partSize, partSize * sizeof(float));
+            memcpy(self->inBuf, self->inBuf + partSize, partSize * sizeof(float));
+            self->fifoPos = 0;
+        }
+    }
+}
+
+static void
+process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+
+    const float* in = self->ports[kFIR_input_0];
+    float* out = self->ports[kFIR_output_0];
+
+    if (!self->useFFT) {
+        process_direct(self, in, out, numFrames);
+    } else if (self->plan == NULL) {
+        memset(out, 0, numFrames * sizeof(float));
+    } else {
+        process_fft(self, in, out, numFrames);
+    }
+}
+
+} // extern "C"
+
+static void
+destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    if (!self->useFFT) {
+        methcla_world_free(world, self->kernel);
+        methcla_world_free(world, self->history);
+    } else {
+        fftplan_cancel(self->request);
+        fftplan_free(world, self->plan);
+        methcla_world_free(world, self->kernelSpectrum);
+    }
+}
+
+static const Methcla_SynthDef descriptor =
+{
+    METHCLA_PLUGINS_FIR_URI,
+    sizeof(Synth),
+    sizeof(Options),
+    configure,
+    port_descriptor,
+    construct,
+    connect,
+    NULL,
+    process,
+    destroy
+};
+
+static const Methcla_Library library = { NULL, NULL };
+
+METHCLA_EXPORT const Methcla_Library* methcla_plugins_fir(const Methcla_Host* host, const char* /* bundlePath */)
+{
+    methcla_host_register_synthdef(host, &descriptor);
+    return &library;
+}
@@ -0,0 +1,231 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <methcla/plugins/freqshift.h>
+
+#include <iostream>
+#include <oscpp/server.hpp>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+
+#define TWOPI 6.283185307179586
+
+// Single sideband frequency shifter.
+//
+// The analytic signal is computed with Olli Niemitalo's allpass pair Hilbert
+// transformer: two cascades of four second order allpass sections whose
+// outputs are 90 degrees apart from roughly 20Hz to 20kHz at 44.1kHz. The two
+// cascades run side by side in lanes, one section at a time.
+//
+// Outputs: upshifted, downshifted, in-phase and quadrature signal.
+
+typedef enum {
+    kFreqShift_freq,
+    kFreqShift_input_0,
+    kFreqShift_output_0,
+    kFreqShift_output_1,
+    kFreqShift_output_2,
+    kFreqShift_output_3,
+    kFreqShiftPorts
+} PortIndex;
+
+static const int kNumSections = 4;
+static const int kNumBranches = 2;
+
+static const float kHilbertCoeffs[kNumSections][kNumBranches] = {
+    { 0.6923878f,     0.4021921162426f },
+    { 0.9360654322959f, 0.8561710882420f },
+    { 0.9882295226860f, 0.9722909545651f },
+    { 0.9987488452737f, 0.9952884791278f }
+};
+
+// Sine table for the shift oscillator, indexed by the upper bits of a 32 bit
+// phase accumulator that wraps around naturally.
+static const int kSinTableBits = 12;
+static const int kSinTableSize = 1 << kSinTableBits;
+static const int kSinFracBits = 32 - kSinTableBits;
+static float sinTable[kSinTableSize + 1];
+
+// Synth Struct, size of Synth ist dieses Struct
+typedef struct {
+    float* ports[kFreqShiftPorts];
+    float a[kNumSections][kNumBranches];
+    float x1[kNumSections][kNumBranches];
+    float x2[kNumSections][kNumBranches];
+    float y1[kNumSections][kNumBranches];
+    float y2[kNumSections][kNumBranches];
+    float delayedI;
+    uint32_t phase;
+    double freqToPhaseInc;
+} Synth;
+
+extern "C" {
+
+static bool
+port_descriptor( const Methcla_SynthOptions* /* options */
+               , Methcla_PortCount index
+               , Methcla_PortDescriptor* port )
+{
+    switch ((PortIndex)index) {
+        case kFreqShift_freq:
+            port->type = kMethcla_ControlPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kFreqShift_input_0:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kFreqShift_output_0:
+        case kFreqShift_output_1:
+        case kFreqShift_output_2:
+        case kFreqShift_output_3:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Output;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void
+construct( const Methcla_World* world
+         , const Methcla_SynthDef* /* synthDef */
+         , const Methcla_SynthOptions* inOptions
+         , Methcla_Synth* synth )
+{
+    Synth* self = (Synth*)synth;
+    for (int s = 0; s < kNumSections; s++) {
+        for (int b = 0; b < kNumBranches; b++) {
+            self->a[s][b] = kHilbertCoeffs[s][b] * kHilbertCoeffs[s][b];
+            self->x1[s][b] = self->x2[s][b] = 0.f;
+            self->y1[s][b] = self->y2[s][b] = 0.f;
+        }
+    }
+    self->delayedI = 0.f;
+    self->phase = 0;
+    self->freqToPhaseInc = 4294967296. / methcla_world_samplerate(world);
+}
+
+static void
+connect( Methcla_Synth* synth
+       , Methcla_PortCount index
+       , void* data )
+{
+    ((Synth*)synth)->ports[index] = (float*)data;
+}
+
+static inline float
+lookup_sin(uint32_t phase)
+{
+    const uint32_t i = phase >> kSinFracBits;
+    const float frac = (phase & ((1u << kSinFracBits) - 1)) * (1.f / (1u << kSinFracBits));
+    return sinTable[i] + frac * (sinTable[i+1] - sinTable[i]);
+}
+
+static void
+process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+
+    const float freq = *self->ports[kFreqShift_freq];
+    const float* in = self->ports[kFreqShift_input_0];
+    float* up = self->ports[kFreqShift_output_0];
+    float* down = self->ports[kFreqShift_output_1];
+    float* outI = self->ports[kFreqShift_output_2];
+    float* outQ = self->ports[kFreqShift_output_3];
+
+    // Negative frequencies wrap to the upper half of the phase range
+    const uint32_t phaseInc = (uint32_t)(int64_t)llrint(freq * self->freqToPhaseInc);
+    uint32_t phase = self->phase;
+
+    float a[kNumSections][kNumBranches];
+    float x1[kNumSections][kNumBranches], x2[kNumSections][kNumBranches];
+    float y1[kNumSections][kNumBranches], y2[kNumSections][kNumBranches];
+    for (int s = 0; s < kNumSections; s++) {
+        for (int b = 0; b < kNumBranches; b++) {
+            a[s][b] = self->a[s][b];
+            x1[s][b] = self->x1[s][b]; x2[s][b] = self->x2[s][b];
+            y1[s][b] = self->y1[s][b]; y2[s][b] = self->y2[s][b];
+        }
+    }
+    float delayedI = self->delayedI;
+
+    for (size_t k = 0; k < numFrames; k++) {
+        float v[kNumBranches] = { in[k], in[k] };
+
+        for (int s = 0; s < kNumSections; s++) {
+            for (int b = 0; b < kNumBranches; b++) {
+                const float y = a[s][b] * (v[b] + y2[s][b]) - x2[s][b];
+                x2[s][b] = x1[s][b]; x1[s][b] = v[b];
+                y2[s][b] = y1[s][b]; y1[s][b] = y;
+                v[b] = y;
+            }
+        }
+
+        // The in-phase branch needs an extra sample of delay
+        const float i = delayedI;
+        const float q = v[1];
+        delayedI = v[0];
+
+        const float c = lookup_sin(phase + (1u << 30));
+        const float s = lookup_sin(phase);
+        phase += phaseInc;
+
+        up[k] = i * c + q * s;
+        down[k] = i * c - q * s;
+        outI[k] = i;
+        outQ[k] = q;
+    }
+
+    for (int s = 0; s < kNumSections; s++) {
+        for (int b = 0; b < kNumBranches; b++) {
+            self->x1[s][b] = x1[s][b]; self->x2[s][b] = x2[s][b];
+            self->y1[s][b] = y1[s][b]; self->y2[s][b] = y2[s][b];
+        }
+    }
+    self->delayedI = delayedI;
+    self->phase = phase;
+}
+
+} // extern "C"
+
+
+static const Methcla_SynthDef descriptor =
+{
+    METHCLA_PLUGINS_FREQSHIFT_URI,
+    sizeof(Synth),
+    0,
+    NULL,
+    port_descriptor,
+    construct,
+    connect,
+    NULL,
+    process,
+    NULL
+};
+
+static const Methcla_Library library = { NULL, NULL };
+
+METHCLA_EXPORT const Methcla_Library* methcla_plugins_freqshift(const Methcla_Host* host, const char* /* bundlePath */)
+{
+    for (int i = 0; i <= kSinTableSize; i++) {
+        sinTable[i] = sin(TWOPI * i / kSinTableSize);
+    }
+    methcla_host_register_synthdef(host, &descriptor);
+    return &library;
+}
@@ -14,12 +14,14 @@
 
 #include <methcla/plugins/hpf.h>
 
+#include <algorithm>
 #include <iostream>
 #include <oscpp/server.hpp>
 #include <unistd.h>
 #include <math.h>
-
-#define PI 3.141592653589793
+#include <string.h>
+#include "biquad.hpp"
+#include "silence.hpp"
 
 typedef enum {
     kHPF_freq,
@@ -30,40 +32,62 @@ typedef enum {
 
 
 // Synth Struct, size of Synth ist dieses Struct
+// With numChannels > 1 the inputs occupy ports kHPF_input_0 .. kHPF_input_0+numChannels-1,
+// followed by the outputs in the same order.
 typedef struct {
-    float* ports[kHPFPorts];
-    double freqmul;
+    float** ports;
+    size_t numChannels;
     size_t samplerate;
-    float del_in[2];
-    float del_out[2];
+    float freq;
+    BiquadCoeffs coeffs;
+    float* state;
+    SilenceTracker silence;
 } Synth;
 
+struct Options
+{
+    size_t numChannels;
+};
+
 extern "C" {
     
     static bool
-    port_descriptor( const Methcla_SynthOptions* /* options */
+    port_descriptor( const Methcla_SynthOptions* inOptions
                     , Methcla_PortCount index
                     , Methcla_PortDescriptor* port )
     {
-        switch ((PortIndex)index) {
-            case kHPF_freq:
-                port->type = kMethcla_ControlPort;
-                port->direction = kMethcla_Input;
-                port->flags = kMethcla_PortFlags;
-                return true;
-            case kHPF_output_0:
-                port->type = kMethcla_AudioPort;
-                port->direction = kMethcla_Output;
-                port->flags = kMethcla_PortFlags;
-                return true;
-            case kHPF_input_0:
-                port->type = kMethcla_AudioPort;
-                port->direction = kMethcla_Input;
-                port->flags = kMethcla_PortFlags;
-                return true;
-            default:
-                return false;
+        const Options* options = (const Options*)inOptions;
+        const size_t numChannels = options->numChannels;
+        
+        if (index == kHPF_freq) {
+            port->type = kMethcla_ControlPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        }
+        else if (index < kHPF_input_0 + numChannels) {
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
         }
+        else if (index < kHPF_input_0 + 2 * numChannels) {
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Output;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        }
+        else {
+            return false;
+        }
+    }
+    
+    static void
+    configure(const void* tags, size_t tags_size, const void* args, size_t args_size, Methcla_SynthOptions* outOptions)
+    {
+        OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
+        Options* options = (Options*)outOptions;
+        options->numChannels = argStream.atEnd() ? 1 : std::max(1, (int)argStream.int32());
     }
     
     static void
@@ -72,13 +96,23 @@ extern "C" {
               , const Methcla_SynthOptions* inOptions
               , Methcla_Synth* synth )
     {
+        const Options* options = (const Options*)inOptions;
         Synth* self = (Synth*)synth;
         self->samplerate = methcla_world_samplerate(world);
-        for (int i = 0; i < 2; ++i)
-        {
-            self->del_in[i]=0;
-            self->del_out[i]=0;
+        self->numChannels = options->numChannels;
+        self->ports = (float**)methcla_world_alloc(world, (kHPF_input_0 + 2 * self->numChannels) * sizeof(float*));
+        
+        const size_t stateSize = biquad_state_size(self->numChannels);
+        self->state = (float*)methcla_world_alloc(world, stateSize * sizeof(float));
+        for (size_t i = 0; i < stateSize; i++) {
+            self->state[i] = 0;
         }
+        
+        // Two samples of memory
+        silence_init(&self->silence, 2);
+        
+        // Force coefficient computation in the first process call
+        self->freq = -1;
     }
     
     static void
@@ -95,49 +129,52 @@ extern "C" {
         Synth* self = (Synth*)synth;
         
         const float freq = *self->ports[kHPF_freq];
-        float* in = self->ports[kHPF_input_0];
-        float* out = self->ports[kHPF_output_0];
-        int sR = self->samplerate;
-        float n, w, a1, a2, a3, b1, b2;
+        float* const* in = self->ports + kHPF_input_0;
+        float* const* out = in + self->numChannels;
+        
+        // Coefficients are shared by all channels and only recomputed on change
+        if (freq != self->freq) {
+            self->coeffs = biquad_hpf(freq, self->samplerate);
+            self->freq = freq;
+        }
         
-        for (size_t k = 0; k < numFrames; k++) {
-            
-            w = tan (PI*freq/sR);
-            
-            n = 1/(pow(w,2) + w + 1);
-            
-            a1 = n;
-            a2 = (-2)*n;
-            a3 = n;
-            b1 = 2*n*(pow(w,2)-1);
-            b2 = n*(pow(w,2) - w + 1);
-            
-            out[k] = in[k]*a1 + self->del_in[0]*a2 + self->del_in[1]*a3 - self->del_out[0]*b1 - self->del_out[1]*b2;
-            
-            self->del_out[1] = self->del_out[0];
-            self->del_out[0] = out[k];
-            
-            self->del_in[1] = self->del_in[0];
-            self->del_in[0] = in[k];
-            
+        const bool inputSilent = silence_check_channels(in, self->numChannels, numFrames);
+        if (silence_skip(&self->silence, inputSilent)) {
+            for (size_t c = 0; c < self->numChannels; c++) {
+                memset(out[c], 0, numFrames * sizeof(float));
+            }
+            return;
+        }
+        
+        biquad_process(self->coeffs, self->state, self->numChannels, in, out, numFrames);
+        const bool outputSilent = silence_check_channels(out, self->numChannels, numFrames);
+        if (silence_update(&self->silence, inputSilent, outputSilent, numFrames)) {
+            memset(self->state, 0, biquad_state_size(self->numChannels) * sizeof(float));
         }
     }
     
 } // extern "C"
 
+static void
+destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    methcla_world_free(world, self->state);
+    methcla_world_free(world, self->ports);
+}
 
 static const Methcla_SynthDef descriptor =
 {
     METHCLA_PLUGINS_HPF_URI,
     sizeof(Synth),
-    0, 
-    NULL,
+    sizeof(Options),
+    configure,
     port_descriptor,
     construct,
     connect,
     NULL,
     process,
-    NULL
+    destroy
 };
 
 static const Methcla_Library library = { NULL, NULL };
@@ -0,0 +1,274 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <methcla/plugins/looper.h>
+
+#include <algorithm>
+#include <iostream>
+#include <oscpp/server.hpp>
+#include <unistd.h>
+#include <math.h>
+#include <string.h>
+#include "mmapbuffer.hpp"
+
+// Loop recorder with overdub and variable speed playback.
+//
+// Options: maxLength (seconds), [numChannels (1-8, default 1)], [path]
+//
+// The loop memory holds maxLength seconds per channel and is memory mapped on
+// the non-realtime side, from the file at path if given and anonymously
+// otherwise. The looper is silent until the mapping has arrived.
+//
+// Controls:
+//   rec      going above 0 records a new loop from the start; when it drops
+//            to 0, or the memory is full, the recorded length becomes the
+//            loop length and playback starts. A full memory ends the take
+//            until rec has dropped to 0 and risen again.
+//   overdub  > 0 adds the input to the loop at the play position
+//   play     > 0 plays the loop, 0 pauses it
+//   speed    playback rate, negative values play backwards
+
+static const size_t kLooperMaxChannels = 8;
+static const float kLooperMaxSpeed = 4.f;
+
+typedef enum {
+    kLooper_rec,
+    kLooper_overdub,
+    kLooper_play,
+    kLooper_speed,
+    kLooperControlPorts
+} ControlPortIndex;
+
+// Synth Struct, size of Synth ist dieses Struct
+typedef struct {
+    float* ports[kLooperControlPorts + 2 * kLooperMaxChannels];
+    size_t numChannels;
+    MMapBuffer* buffer;
+    MMapBufferRequest* request;
+    size_t maxFrames;       // per channel
+    size_t length;          // loop length in frames, 0 when empty
+    double pos;             // play position in frames
+    bool recording;
+    bool recHeld;           // rec was > 0 in the last block
+} Synth;
+
+struct Options {
+    float maxLength;
+    size_t numChannels;
+    char path[kMMapBufferMaxPath];
+};
+
+extern "C" {
+
+static bool
+port_descriptor( const Methcla_SynthOptions* inOptions
+               , Methcla_PortCount index
+               , Methcla_PortDescriptor* port )
+{
+    const Options* options = (const Options*)inOptions;
+    if (index < kLooperControlPorts) {
+        port->type = kMethcla_ControlPort;
+        port->direction = kMethcla_Input;
+        port->flags = kMethcla_PortFlags;
+        return true;
+    }
+    index -= kLooperControlPorts;
+    if (index < 2 * options->numChannels) {
+        port->type = kMethcla_AudioPort;
+        port->direction = index < options->numChannels ? kMethcla_Input : kMethcla_Output;
+        port->flags = kMethcla_PortFlags;
+        return true;
+    }
+    return false;
+}
+
+static void
+configure(const void* tags, size_t tags_size, const void* args, size_t args_size, Methcla_SynthOptions* outOptions)
+{
+    OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
+    Options* options = (Options*)outOptions;
+    options->maxLength = argStream.tag() == 'i' ? argStream.int32() : argStream.float32();
+    const int numChannels = argStream.atEnd() ? 1 : argStream.int32();
+    options->numChannels = std::min(kLooperMaxChannels, (size_t)std::max(1, numChannels));
+    options->path[0] = '\0';
+    if (!argStream.atEnd()) {
+        strncpy(options->path, argStream.string(), kMMapBufferMaxPath - 1);
+        options->path[kMMapBufferMaxPath - 1] = '\0';
+    }
+}
+
+static void
+set_buffer(const Methcla_World* world, Methcla_Synth* synth, MMapBuffer* buffer)
+{
+    Synth* self = (Synth*)synth;
+    self->request = NULL;
+    // Release previous storage, if any
+    mmapbuffer_free(world, self->buffer);
+    self->buffer = buffer;
+    self->length = 0;
+    self->pos = 0.;
+    self->recording = false;
+}
+
+static void
+construct( const Methcla_World* world
+         , const Methcla_SynthDef* /* synthDef */
+         , const Methcla_SynthOptions* inOptions
+         , Methcla_Synth* synth )
+{
+    const Options* options = (const Options*)inOptions;
+    Synth* self = (Synth*)synth;
+
+    self->numChannels = options->numChannels;
+    self->maxFrames = std::max(1., ceil(options->maxLength * methcla_world_samplerate(world)));
+    self->buffer = NULL;
+    self->length = 0;
+    self->pos = 0.;
+    self->recording = false;
+    self->recHeld = false;
+    self->request = mmapbuffer_request(world, synth, self->numChannels * self->maxFrames, options->path, set_buffer);
+}
+
+static void
+connect( Methcla_Synth* synth
+       , Methcla_PortCount index
+       , void* data )
+{
+    ((Synth*)synth)->ports[index] = (float*)data;
+}
+
+static void
+clear_outputs(Synth* self, size_t numFrames)
+{
+    float* const* outs = self->ports + kLooperControlPorts + self->numChannels;
+    for (size_t c = 0; c < self->numChannels; c++) {
+        memset(outs[c], 0, numFrames * sizeof(float));
+    }
+}
+
+// Append to the loop being recorded; stops recording when the memory is full.
+static void
+record(Synth* self, size_t numFrames)
+{
+    float* const* ins = self->ports + kLooperControlPorts;
+    const size_t n = std::min(numFrames, self->maxFrames - self->length);
+    for (size_t c = 0; c < self->numChannels; c++) {
+        float* loop = self->buffer->data + c * self->maxFrames;
+        memcpy(loop + self->length, ins[c], n * sizeof(float));
+    }
+    self->length += n;
+    if (self->length == self->maxFrames) {
+        self->recording = false;
+        self->pos = 0.;
+    }
+}
+
+static void
+play(Synth* self, size_t numFrames, float speed, bool overdub)
+{
+    float* const* ins = self->ports + kLooperControlPorts;
+    float* const* outs = ins + self->numChannels;
+    const size_t length = self->length;
+    const double end = length;
+    double pos = self->pos;
+
+    for (size_t c = 0; c < self->numChannels; c++) {
+        float* loop = self->buffer->data + c * self->maxFrames;
+        const float* in = ins[c];
+        float* out = outs[c];
+        pos = self->pos;
+        for (size_t k = 0; k < numFrames; k++) {
+            const size_t i0 = std::min((size_t)pos, length - 1);
+            const size_t i1 = i0 + 1 == length ? 0 : i0 + 1;
+            const float frac = pos - i0;
+            out[k] = loop[i0] + frac * (loop[i1] - loop[i0]);
+            if (overdub) loop[i0] += in[k];
+            pos += speed;
+            // |speed| may exceed a short loop's length
+            if (pos >= end || pos < 0.) {
+                pos = fmod(pos, end);
+                if (pos < 0.) pos += end;
+                // A tiny negative remainder can round up to end
+                if (pos >= end) pos = 0.;
+            }
+        }
+    }
+
+    self->pos = pos;
+}
+
+static void
+process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+
+    if (self->buffer == NULL) {
+        clear_outputs(self, numFrames);
+        return;
+    }
+
+    const bool rec = *self->ports[kLooper_rec] > 0.f;
+    const bool recStart = rec && !self->recHeld;
+    self->recHeld = rec;
+    if (recStart) {
+        self->recording = true;
+        self->length = 0;
+        self->pos = 0.;
+    } else if (!rec && self->recording) {
+        self->recording = false;
+        self->pos = 0.;
+    }
+
+    if (self->recording) {
+        record(self, numFrames);
+        clear_outputs(self, numFrames);
+    } else if (*self->ports[kLooper_play] > 0.f && self->length > 0) {
+        const float speed = std::max(-kLooperMaxSpeed, std::min(*self->ports[kLooper_speed], kLooperMaxSpeed));
+        play(self, numFrames, speed, *self->ports[kLooper_overdub] > 0.f);
+    } else {
+        clear_outputs(self, numFrames);
+    }
+}
+
+} // extern "C"
+
+static void
+destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    mmapbuffer_cancel(self->request);
+    mmapbuffer_free(world, self->buffer);
+}
+
+static const Methcla_SynthDef descriptor =
+{
+    METHCLA_PLUGINS_LOOPER_URI,
+    sizeof(Synth),
+    sizeof(Options),
+    configure,
+    port_descriptor,
+    construct,
+    connect,
+    NULL,
+    process,
+    destroy
+};
+
+static const Methcla_Library library = { NULL, NULL };
+
+METHCLA_EXPORT const Methcla_Library* methcla_plugins_looper(const Methcla_Host* host, const char* /* bundlePath */)
+{
+    methcla_host_register_synthdef(host, &descriptor);
+    return &library;
+}
@@ -0,0 +1,157 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef METHCLA_PLUGINS_MMAPBUFFER_HPP_INCLUDED
+#define METHCLA_PLUGINS_MMAPBUFFER_HPP_INCLUDED
+
+#include <methcla/plugin.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Memory mapped sample storage for buffers too large for the world allocator,
+// following the same request protocol as nrtbuffer.hpp.
+//
+// The mapping is either anonymous or backed by a file, which is created or
+// extended to the requested size and keeps its previous contents. It is set up
+// in a host command, where every page is touched (and locked when permitted)
+// so that the audio thread never takes a page fault, and handed to the synth
+// in a world command at a block boundary. Installing a new buffer in the
+// callback and releasing the old one with mmapbuffer_free swaps storage
+// without allocating on the audio thread.
+
+static const size_t kMMapBufferMaxPath = 256;
+
+struct MMapBuffer
+{
+    float* data;
+    size_t size;    // floats
+};
+
+typedef void (*MMapBufferCallback)(const Methcla_World* world, Methcla_Synth* synth, MMapBuffer* buffer);
+
+struct MMapBufferRequest
+{
+    Methcla_Synth* synth;   // NULL when cancelled
+    MMapBufferCallback callback;
+    size_t size;
+    char path[kMMapBufferMaxPath];  // empty for an anonymous mapping
+    MMapBuffer* buffer;
+};
+
+static void
+mmapbuffer_host_free(const Methcla_Host* /* host */, void* data)
+{
+    MMapBuffer* buffer = (MMapBuffer*)data;
+    munmap(buffer->data, buffer->size * sizeof(float));
+    free(buffer);
+}
+
+static void
+mmapbuffer_world_install(const Methcla_World* world, void* data)
+{
+    MMapBufferRequest* request = (MMapBufferRequest*)data;
+    if (request->synth != NULL) {
+        request->callback(world, request->synth, request->buffer);
+    } else if (request->buffer != NULL) {
+        methcla_world_perform_command(world, mmapbuffer_host_free, request->buffer);
+    }
+    methcla_world_free(world, request);
+}
+
+static void*
+mmapbuffer_map(const char* path, size_t bytes)
+{
+    if (path[0] == '\0') {
+        return mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    }
+    const int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) return MAP_FAILED;
+    void* data = MAP_FAILED;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && ((size_t)st.st_size >= bytes || ftruncate(fd, bytes) == 0)) {
+        data = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    // The mapping keeps the file open
+    close(fd);
+    return data;
+}
+
+static void
+mmapbuffer_host_alloc(const Methcla_Host* host, void* data)
+{
+    MMapBufferRequest* request = (MMapBufferRequest*)data;
+    const size_t bytes = request->size * sizeof(float);
+    void* mem = mmapbuffer_map(request->path, bytes);
+
+    if (mem != MAP_FAILED) {
+        // Pre-fault every page, keeping the contents of a file mapping
+        const size_t pageSize = sysconf(_SC_PAGESIZE);
+        volatile char* p = (volatile char*)mem;
+        for (size_t i = 0; i < bytes; i += pageSize) {
+            p[i] = p[i];
+        }
+        // Best effort, fails without the privilege or beyond RLIMIT_MEMLOCK
+        mlock(mem, bytes);
+
+        request->buffer = (MMapBuffer*)malloc(sizeof(MMapBuffer));
+        if (request->buffer != NULL) {
+            request->buffer->data = (float*)mem;
+            request->buffer->size = request->size;
+        } else {
+            munmap(mem, bytes);
+        }
+    }
+
+    methcla_host_perform_command(host, mmapbuffer_world_install, request);
+}
+
+// Request a mapping of size floats, anonymous (zeroed) if path is NULL or
+// empty. The callback runs in the realtime context and receives NULL if the
+// mapping failed; the returned request is only valid until then.
+inline MMapBufferRequest*
+mmapbuffer_request(const Methcla_World* world, Methcla_Synth* synth, size_t size, const char* path, MMapBufferCallback callback)
+{
+    MMapBufferRequest* request = (MMapBufferRequest*)methcla_world_alloc(world, sizeof(MMapBufferRequest));
+    if (request == NULL) return NULL;
+    request->synth = synth;
+    request->callback = callback;
+    request->size = size;
+    request->path[0] = '\0';
+    if (path != NULL) {
+        strncpy(request->path, path, kMMapBufferMaxPath - 1);
+        request->path[kMMapBufferMaxPath - 1] = '\0';
+    }
+    request->buffer = NULL;
+    methcla_world_perform_command(world, mmapbuffer_host_alloc, request);
+    return request;
+}
+
+inline void
+mmapbuffer_cancel(MMapBufferRequest* request)
+{
+    if (request != NULL) request->synth = NULL;
+}
+
+inline void
+mmapbuffer_free(const Methcla_World* world, MMapBuffer* buffer)
+{
+    if (buffer != NULL) methcla_world_perform_command(world, mmapbuffer_host_free, buffer);
+}
+
+#endif // METHCLA_PLUGINS_MMAPBUFFER_HPP_INCLUDED
@@ -0,0 +1,241 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <methcla/plugins/modal.h>
+
+#include <algorithm>
+#include <iostream>
+#include <oscpp/server.hpp>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#define TWOPI 6.283185307179586
+
+// Modal resonator bank.
+//
+// Options: numModes (int), followed by freq (Hz), decay (T60 in seconds) and
+// gain for each mode. Every mode is a two pole resonator driven by the input;
+// gain is the amplitude of the mode's response to a unit impulse.
+//
+// The modes are stored structure-of-arrays and padded to a multiple of
+// kModalLanes, so the per-sample loop over all modes vectorizes.
+
+static const size_t kModalMaxModes = 64;
+static const size_t kModalLanes = 4;
+
+typedef enum {
+    kModal_freqScale,
+    kModal_decayScale,
+    kModal_input_0,
+    kModal_output_0,
+    kModalPorts
+} PortIndex;
+
+// Synth Struct, size of Synth ist dieses Struct
+typedef struct {
+    float* ports[kModalPorts];
+    size_t numModes;    // padded to a multiple of kModalLanes
+    double sampleRate;
+    float freqScale;
+    float decayScale;
+    // Mode parameters
+    float* freq;
+    float* decay;
+    float* gain;
+    // Resonator coefficients and state
+    float* b0;
+    float* a1;
+    float* a2;
+    float* y1;
+    float* y2;
+} Synth;
+
+struct Options {
+    size_t numModes;
+    float freq[kModalMaxModes];
+    float decay[kModalMaxModes];
+    float gain[kModalMaxModes];
+};
+
+extern "C" {
+
+static bool
+port_descriptor( const Methcla_SynthOptions* /* options */
+               , Methcla_PortCount index
+               , Methcla_PortDescriptor* port )
+{
+    switch ((PortIndex)index) {
+        case kModal_freqScale:
+        case kModal_decayScale:
+            port->type = kMethcla_ControlPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kModal_input_0:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kModal_output_0:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Output;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void
+configure(const void* tags, size_t tags_size, const void* args, size_t args_size, Methcla_SynthOptions* outOptions)
+{
+    OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
+    Options* options = (Options*)outOptions;
+    options->numModes = std::min(kModalMaxModes, (size_t)std::max(0, (int)argStream.int32()));
+    for (size_t i = 0; i < options->numModes; i++) {
+        options->freq[i] = argStream.float32();
+        options->decay[i] = argStream.float32();
+        options->gain[i] = argStream.float32();
+    }
+}
+
+static void
+update_coeffs(Synth* self, float freqScale, float decayScale)
+{
+    for (size_t m = 0; m < self->numModes; m++) {
+        const double w = TWOPI * self->freq[m] * freqScale / self->sampleRate;
+        const double t60 = self->decay[m] * decayScale;
+        if (w <= 0. || w >= TWOPI / 2. || t60 <= 0.) {
+            // Silence modes above Nyquist and padding lanes
+            self->b0[m] = self->a1[m] = self->a2[m] = 0.f;
+        } else {
+            // Pole radius for a decay of 60dB after t60 seconds
+            const double r = exp(-6.907755278982137 / (t60 * self->sampleRate));
+            self->b0[m] = self->gain[m] * sin(w);
+            self->a1[m] = 2. * r * cos(w);
+            self->a2[m] = r * r;
+        }
+    }
+    self->freqScale = freqScale;
+    self->decayScale = decayScale;
+}
+
+static void
+construct( const Methcla_World* world
+         , const Methcla_SynthDef* /* synthDef */
+         , const Methcla_SynthOptions* inOptions
+         , Methcla_Synth* synth )
+{
+    const Options* options = (const Options*)inOptions;
+    Synth* self = (Synth*)synth;
+
+    const size_t numModes = (options->numModes + kModalLanes - 1) / kModalLanes * kModalLanes;
+    self->numModes = numModes;
+    self->sampleRate = methcla_world_samplerate(world);
+
+    float* mem = (float*)methcla_world_alloc(world, std::max((size_t)1, 8 * numModes) * sizeof(float));
+    memset(mem, 0, 8 * numModes * sizeof(float));
+    self->freq  = mem;
+    self->decay = mem + numModes;
+    self->gain  = mem + 2 * numModes;
+    self->b0    = mem + 3 * numModes;
+    self->a1    = mem + 4 * numModes;
+    self->a2    = mem + 5 * numModes;
+    self->y1    = mem + 6 * numModes;
+    self->y2    = mem + 7 * numModes;
+
+    for (size_t m = 0; m < options->numModes; m++) {
+        self->freq[m] = options->freq[m];
+        self->decay[m] = options->decay[m];
+        self->gain[m] = options->gain[m];
+    }
+
+    update_coeffs(self, 1.f, 1.f);
+}
+
+static void
+connect( Methcla_Synth* synth
+       , Methcla_PortCount index
+       , void* data )
+{
+    ((Synth*)synth)->ports[index] = (float*)data;
+}
+
+static void
+process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+
+    const float freqScale = *self->ports[kModal_freqScale];
+    const float decayScale = *self->ports[kModal_decayScale];
+    const float* in = self->ports[kModal_input_0];
+    float* out = self->ports[kModal_output_0];
+
+    if (freqScale != self->freqScale || decayScale != self->decayScale) {
+        update_coeffs(self, freqScale, decayScale);
+    }
+
+    const size_t numModes = self->numModes;
+    const float* b0 = self->b0;
+    const float* a1 = self->a1;
+    const float* a2 = self->a2;
+    float* y1 = self->y1;
+    float* y2 = self->y2;
+
+    for (size_t k = 0; k < numFrames; k++) {
+        const float x = in[k];
+        float sum[kModalLanes] = { 0.f };
+        for (size_t m = 0; m < numModes; m += kModalLanes) {
+            for (size_t l = 0; l < kModalLanes; l++) {
+                const float y = b0[m+l] * x + a1[m+l] * y1[m+l] - a2[m+l] * y2[m+l];
+                y2[m+l] = y1[m+l];
+                y1[m+l] = y;
+                sum[l] += y;
+            }
+        }
+        out[k] = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+    }
+}
+
+} // extern "C"
+
+static void
+destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    methcla_world_free(world, self->freq);
+}
+
+static const Methcla_SynthDef descriptor =
+{
+    METHCLA_PLUGINS_MODAL_URI,
+    sizeof(Synth),
+    sizeof(Options),
+    configure,
+    port_descriptor,
+    construct,
+    connect,
+    NULL,
+    process,
+    destroy
+};
+
+static const Methcla_Library library = { NULL, NULL };
+
+METHCLA_EXPORT const Methcla_Library* methcla_plugins_modal(const Methcla_Host* host, const char* /* bundlePath */)
+{
+    methcla_host_register_synthdef(host, &descriptor);
+    return &library;
+}
@@ -0,0 +1,619 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <methcla/plugins/moddelay.h>
+
+#include <algorithm>
+#include <iostream>
+#include <oscpp/server.hpp>
+#include <unistd.h>
+#include <math.h>
+#include <string.h>
+#include "delayline.hpp"
+#include "nrtbuffer.hpp"
+
+#define PI 3.141592653589793
+#define TWOPI 6.283185307179586
+
+// Delay with an audio rate delay time and high order interpolation.
+//
+// moddelay
+//   Options: maxDelay (seconds), [interpolation (0: Lagrange-3 (default),
+//   1: allpass, 2: windowed sinc)]
+//   Ports: fb (control), time (audio, seconds), input, output
+//
+// chorus and flanger are presets on the same engine with an internal sine
+// LFO and Lagrange-3 interpolation.
+//   chorus:  rate, depth, mix, input, output
+//   flanger: rate, depth, fb, mix, input, output
+//
+// The fractional delay coefficients for a whole block are computed up front
+// in plain loops over the block (structure-of-arrays for Lagrange, one row of
+// taps per sample for sinc), which the compiler vectorizes. The recursive
+// part, read - write with feedback, then runs per sample.
+
+typedef enum {
+    kInterp_lagrange3,
+    kInterp_allpass,
+    kInterp_sinc,
+    kInterpModes
+} Interpolation;
+
+static const int kSincTaps = 8;
+static const int kSincPhases = 256;
+static float sincTable[(kSincPhases + 1) * kSincTaps];
+
+// Largest number of coefficients per sample
+static const int kMaxCoeffs = kSincTaps;
+
+struct ModDelay
+{
+    DelayLine delay;
+    NRTBufferRequest* request;
+    int interp;
+    float minDelay;     // samples
+    float maxDelay;     // samples
+    float apState;      // allpass interpolator output memory
+    size_t* pos;        // per sample integer delay
+    float* coeffs;      // per sample interpolation coefficients
+};
+
+static void
+moddelay_set_buffer(const Methcla_World* world, Methcla_Synth* synth, float* buffer);
+
+// The ModDelay has to be the first member of each synth struct
+static void
+moddelay_init(const Methcla_World* world, Methcla_Synth* synth, ModDelay* md, float maxDelay, int interp)
+{
+    const float sampleRate = methcla_world_samplerate(world);
+    const size_t blockSize = methcla_world_block_size(world);
+
+    md->interp = interp;
+    // Smallest delay for which every interpolation point lies in the past
+    md->minDelay = interp == kInterp_sinc ? kSincTaps / 2 : 2.f;
+    md->maxDelay = std::max(md->minDelay, floorf(maxDelay * sampleRate));
+    md->apState = 0.f;
+    md->pos = (size_t*)methcla_world_alloc(world, blockSize * sizeof(size_t));
+    md->coeffs = (float*)methcla_world_alloc(world, kMaxCoeffs * blockSize * sizeof(float));
+
+    const size_t size = delayline_size(md->maxDelay + kSincTaps, blockSize);
+    delayline_init(&md->delay, NULL, size);
+    md->request = nrtbuffer_request(world, synth, size + 1, moddelay_set_buffer);
+}
+
+static void
+moddelay_destroy(const Methcla_World* world, ModDelay* md)
+{
+    nrtbuffer_cancel(md->request);
+    nrtbuffer_free(world, md->delay.buffer);
+    methcla_world_free(world, md->pos);
+    methcla_world_free(world, md->coeffs);
+}
+
+static void
+moddelay_set_buffer(const Methcla_World* world, Methcla_Synth* synth, float* buffer)
+{
+    ModDelay* md = (ModDelay*)synth;
+    md->request = NULL;
+    md->delay.buffer = buffer;
+}
+
+// Lagrange-3 around delay d = pos + f, reading delays pos-1 .. pos+2
+static void
+lagrange3_coeffs(ModDelay* md, const float* delay, size_t numFrames)
+{
+    float* c0 = md->coeffs;
+    float* c1 = c0 + numFrames;
+    float* c2 = c1 + numFrames;
+    float* c3 = c2 + numFrames;
+    for (size_t k = 0; k < numFrames; k++) {
+        const float d = std::max(md->minDelay, std::min(delay[k], md->maxDelay));
+        const size_t di = (size_t)d;
+        const float f = d - di;
+        md->pos[k] = di;
+        c0[k] = -f * (f - 1.f) * (f - 2.f) * (1.f / 6.f);
+        c1[k] = (f + 1.f) * (f - 1.f) * (f - 2.f) * 0.5f;
+        c2[k] = -(f + 1.f) * f * (f - 2.f) * 0.5f;
+        c3[k] = (f + 1.f) * f * (f - 1.f) * (1.f / 6.f);
+    }
+}
+
+// First order allpass with fractional delay in [0.5, 1.5), reading delays pos
+// and pos+1
+static void
+allpass_coeffs(ModDelay* md, const float* delay, size_t numFrames)
+{
+    float* eta = md->coeffs;
+    for (size_t k = 0; k < numFrames; k++) {
+        const float d = std::max(md->minDelay, std::min(delay[k], md->maxDelay));
+        const size_t di = (size_t)(d - 0.5f);
+        const float f = d - di;
+        md->pos[k] = di;
+        eta[k] = (1.f - f) / (1.f + f);
+    }
+}
+
+// Windowed sinc, reading delays pos-3 .. pos+4
+static void
+sinc_coeffs(ModDelay* md, const float* delay, size_t numFrames)
+{
+    for (size_t k = 0; k < numFrames; k++) {
+        const float d = std::max(md->minDelay, std::min(delay[k], md->maxDelay));
+        const size_t di = (size_t)d;
+        const float phase = (d - di) * kSincPhases;
+        const int p = (int)phase;
+        const float w = phase - p;
+        const float* t0 = sincTable + p * kSincTaps;
+        const float* t1 = t0 + kSincTaps;
+        float* c = md->coeffs + k * kSincTaps;
+        md->pos[k] = di;
+        for (int j = 0; j < kSincTaps; j++) {
+            c[j] = t0[j] + w * (t1[j] - t0[j]);
+        }
+    }
+}
+
+// delay in samples per frame
+static void
+moddelay_process(ModDelay* md, const float* delay, const float* in, float* out, float fb, size_t numFrames)
+{
+    DelayLine* dl = &md->delay;
+
+    if (dl->buffer == NULL) {
+        memset(out, 0, numFrames * sizeof(float));
+        return;
+    }
+
+    const float* buffer = dl->buffer;
+    const size_t mask = dl->mask;
+
+    switch (md->interp) {
+        case kInterp_allpass: {
+            allpass_coeffs(md, delay, numFrames);
+            const float* eta = md->coeffs;
+            float y1 = md->apState;
+            for (size_t k = 0; k < numFrames; k++) {
+                const size_t r = dl->wp - md->pos[k];
+                const float y = eta[k] * (buffer[r & mask] - y1) + buffer[(r - 1) & mask];
+                y1 = y;
+                const float x = in[k];
+                out[k] = y;
+                delayline_write(dl, x + fb * y);
+            }
+            md->apState = y1;
+            break;
+        }
+        case kInterp_sinc: {
+            sinc_coeffs(md, delay, numFrames);
+            for (size_t k = 0; k < numFrames; k++) {
+                const float* c = md->coeffs + k * kSincTaps;
+                const size_t r = dl->wp - md->pos[k] + kSincTaps / 2 - 1;
+                float y = 0.f;
+                for (int j = 0; j < kSincTaps; j++) {
+                    y += c[j] * buffer[(r - j) & mask];
+                }
+                const float x = in[k];
+                out[k] = y;
+                delayline_write(dl, x + fb * y);
+            }
+            break;
+        }
+        default: {
+            lagrange3_coeffs(md, delay, numFrames);
+            const float* c0 = md->coeffs;
+            const float* c1 = c0 + numFrames;
+            const float* c2 = c1 + numFrames;
+            const float* c3 = c2 + numFrames;
+            for (size_t k = 0; k < numFrames; k++) {
+                const size_t r = dl->wp - md->pos[k] + 1;
+                const float y = c0[k] * buffer[r & mask]
+                              + c1[k] * buffer[(r - 1) & mask]
+                              + c2[k] * buffer[(r - 2) & mask]
+                              + c3[k] * buffer[(r - 3) & mask];
+                const float x = in[k];
+                out[k] = y;
+                delayline_write(dl, x + fb * y);
+            }
+            break;
+        }
+    }
+}
+
+static void
+build_sinc_table()
+{
+    // Hann windowed sinc; tap j sits at delay pos - kSincTaps/2 + 1 + j
+    const int half = kSincTaps / 2;
+    for (int p = 0; p <= kSincPhases; p++) {
+        const double f = (double)p / kSincPhases;
+        float* c = sincTable + p * kSincTaps;
+        double sum = 0.;
+        for (int j = 0; j < kSincTaps; j++) {
+            const double x = j - (half - 1) - f;
+            const double s = fabs(x) < 1e-9 ? 1. : sin(PI * x) / (PI * x);
+            const double w = 0.5 * (1. + cos(PI * x / half));
+            c[j] = s * w;
+            sum += c[j];
+        }
+        // Unity gain at DC
+        for (int j = 0; j < kSincTaps; j++) {
+            c[j] /= sum;
+        }
+    }
+}
+
+static void
+write_control_port(Methcla_PortDescriptor* port)
+{
+    port->type = kMethcla_ControlPort;
+    port->direction = kMethcla_Input;
+    port->flags = kMethcla_PortFlags;
+}
+
+static void
+write_audio_port(Methcla_PortDescriptor* port, Methcla_PortDirection direction)
+{
+    port->type = kMethcla_AudioPort;
+    port->direction = direction;
+    port->flags = kMethcla_PortFlags;
+}
+
+// ---------------------------------------------------------------------------
+// moddelay
+
+namespace moddelay {
+
+typedef enum {
+    kModDelay_fb,
+    kModDelay_time,
+    kModDelay_input_0,
+    kModDelay_output_0,
+    kModDelayPorts
+} PortIndex;
+
+// Synth Struct, size of Synth ist dieses Struct
+typedef struct {
+    ModDelay md;
+    float* ports[kModDelayPorts];
+    float sampleRate;
+    float* delay;
+} Synth;
+
+struct Options {
+    float maxDelay;
+    int interp;
+};
+
+extern "C" {
+
+static bool
+port_descriptor( const Methcla_SynthOptions* /* options */
+               , Methcla_PortCount index
+               , Methcla_PortDescriptor* port )
+{
+    switch ((PortIndex)index) {
+        case kModDelay_fb:
+            write_control_port(port);
+            return true;
+        case kModDelay_time:
+        case kModDelay_input_0:
+            write_audio_port(port, kMethcla_Input);
+            return true;
+        case kModDelay_output_0:
+            write_audio_port(port, kMethcla_Output);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void
+configure(const void* tags, size_t tags_size, const void* args, size_t args_size, Methcla_SynthOptions* outOptions)
+{
+    OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
+    Options* options = (Options*)outOptions;
+    options->maxDelay = argStream.tag() == 'i' ? argStream.int32() : argStream.float32();
+    const int interp = argStream.atEnd() ? kInterp_lagrange3 : argStream.int32();
+    options->interp = interp >= 0 && interp < kInterpModes ? interp : kInterp_lagrange3;
+}
+
+static void
+construct( const Methcla_World* world
+         , const Methcla_SynthDef* /* synthDef */
+         , const Methcla_SynthOptions* inOptions
+         , Methcla_Synth* synth )
+{
+    const Options* options = (const Options*)inOptions;
+    Synth* self = (Synth*)synth;
+    self->sampleRate = methcla_world_samplerate(world);
+    self->delay = (float*)methcla_world_alloc(world, methcla_world_block_size(world) * sizeof(float));
+    moddelay_init(world, synth, &self->md, options->maxDelay, options->interp);
+}
+
+static void
+connect( Methcla_Synth* synth
+       , Methcla_PortCount index
+       , void* data )
+{
+    ((Synth*)synth)->ports[index] = (float*)data;
+}
+
+static void
+process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+    const float fb = *self->ports[kModDelay_fb];
+    const float* time = self->ports[kModDelay_time];
+
+    for (size_t k = 0; k < numFrames; k++) {
+        self->delay[k] = time[k] * self->sampleRate;
+    }
+
+    moddelay_process(&self->md, self->delay, self->ports[kModDelay_input_0], self->ports[kModDelay_output_0], fb, numFrames);
+}
+
+static void
+destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    moddelay_destroy(world, &self->md);
+    methcla_world_free(world, self->delay);
+}
+
+} // extern "C"
+
+static const Methcla_SynthDef descriptor =
+{
+    METHCLA_PLUGINS_MODDELAY_URI,
+    sizeof(Synth),
+    sizeof(Options),
+    configure,
+    port_descriptor,
+    construct,
+    connect,
+    NULL,
+    process,
+    destroy
+};
+
+} // namespace moddelay
+
+// ---------------------------------------------------------------------------
+// chorus and flanger
+
+namespace modulation {
+
+typedef enum {
+    kChorus_rate,
+    kChorus_depth,
+    kChorus_mix,
+    kChorus_input_0,
+    kChorus_output_0,
+    kChorusPorts
+} ChorusPortIndex;
+
+typedef enum {
+    kFlanger_rate,
+    kFlanger_depth,
+    kFlanger_fb,
+    kFlanger_mix,
+    kFlanger_input_0,
+    kFlanger_output_0,
+    kFlangerPorts
+} FlangerPortIndex;
+
+// Delay sweep in seconds: base + depth * range * (1 + lfo) / 2
+static const float kChorusBase = 0.012f;
+static const float kChorusRange = 0.016f;
+static const float kFlangerBase = 0.0005f;
+static const float kFlangerRange = 0.006f;
+
+// Synth Struct, size of Synth ist dieses Struct
+typedef struct {
+    ModDelay md;
+    float* ports[kFlangerPorts];
+    float sampleRate;
+    double lfoPhase;
+    float* delay;
+    float* wet;
+} Synth;
+
+extern "C" {
+
+static bool
+chorus_port_descriptor( const Methcla_SynthOptions* /* options */
+                      , Methcla_PortCount index
+                      , Methcla_PortDescriptor* port )
+{
+    switch ((ChorusPortIndex)index) {
+        case kChorus_rate:
+        case kChorus_depth:
+        case kChorus_mix:
+            write_control_port(port);
+            return true;
+        case kChorus_input_0:
+            write_audio_port(port, kMethcla_Input);
+            return true;
+        case kChorus_output_0:
+            write_audio_port(port, kMethcla_Output);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool
+flanger_port_descriptor( const Methcla_SynthOptions* /* options */
+                       , Methcla_PortCount index
+                       , Methcla_PortDescriptor* port )
+{
+    switch ((FlangerPortIndex)index) {
+        case kFlanger_rate:
+        case kFlanger_depth:
+        case kFlanger_fb:
+        case kFlanger_mix:
+            write_control_port(port);
+            return true;
+        case kFlanger_input_0:
+            write_audio_port(port, kMethcla_Input);
+            return true;
+        case kFlanger_output_0:
+            write_audio_port(port, kMethcla_Output);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void
+modulation_construct(const Methcla_World* world, Methcla_Synth* synth, float maxDelay)
+{
+    Synth* self = (Synth*)synth;
+    const size_t blockSize = methcla_world_block_size(world);
+    self->sampleRate = methcla_world_samplerate(world);
+    self->lfoPhase = 0.;
+    self->delay = (float*)methcla_world_alloc(world, 2 * blockSize * sizeof(float));
+    self->wet = self->delay + blockSize;
+    moddelay_init(world, synth, &self->md, maxDelay, kInterp_lagrange3);
+}
+
+static void
+chorus_construct( const Methcla_World* world
+                , const Methcla_SynthDef* /* synthDef */
+                , const Methcla_SynthOptions* /* inOptions */
+                , Methcla_Synth* synth )
+{
+    modulation_construct(world, synth, kChorusBase + kChorusRange);
+}
+
+static void
+flanger_construct( const Methcla_World* world
+                 , const Methcla_SynthDef* /* synthDef */
+                 , const Methcla_SynthOptions* /* inOptions */
+                 , Methcla_Synth* synth )
+{
+    modulation_construct(world, synth, kFlangerBase + kFlangerRange);
+}
+
+static void
+modulation_connect( Methcla_Synth* synth
+       , Methcla_PortCount index
+       , void* data )
+{
+    ((Synth*)synth)->ports[index] = (float*)data;
+}
+
+static void
+modulation_process(Synth* self, float rate, float depth, float fb, float mix, const float* in, float* out, float base, float range, size_t numFrames)
+{
+    const float sampleRate = self->sampleRate;
+    const double lfoInc = TWOPI * rate / sampleRate;
+    const float center = (base + 0.5f * depth * range) * sampleRate;
+    const float sweep = 0.5f * depth * range * sampleRate;
+    double lfoPhase = self->lfoPhase;
+
+    for (size_t k = 0; k < numFrames; k++) {
+        self->delay[k] = center + sweep * sin(lfoPhase);
+        lfoPhase += lfoInc;
+    }
+    self->lfoPhase = fmod(lfoPhase, TWOPI);
+
+    moddelay_process(&self->md, self->delay, in, self->wet, fb, numFrames);
+
+    const float dry = 1.f - mix;
+    for (size_t k = 0; k < numFrames; k++) {
+        out[k] = dry * in[k] + mix * self->wet[k];
+    }
+}
+
+static void
+chorus_process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+    modulation_process( self
+                      , *self->ports[kChorus_rate]
+                      , std::max(0.f, std::min(1.f, *self->ports[kChorus_depth]))
+                      , 0.f
+                      , *self->ports[kChorus_mix]
+                      , self->ports[kChorus_input_0]
+                      , self->ports[kChorus_output_0]
+                      , kChorusBase, kChorusRange
+                      , numFrames );
+}
+
+static void
+flanger_process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+    modulation_process( self
+                      , *self->ports[kFlanger_rate]
+                      , std::max(0.f, std::min(1.f, *self->ports[kFlanger_depth]))
+                      , std::max(-0.95f, std::min(0.95f, *self->ports[kFlanger_fb]))
+                      , *self->ports[kFlanger_mix]
+                      , self->ports[kFlanger_input_0]
+                      , self->ports[kFlanger_output_0]
+                      , kFlangerBase, kFlangerRange
+                      , numFrames );
+}
+
+static void
+modulation_destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    moddelay_destroy(world, &self->md);
+    methcla_world_free(world, self->delay);
+}
+
+} // extern "C"
+
+static const Methcla_SynthDef chorusDescriptor =
+{
+    METHCLA_PLUGINS_CHORUS_URI,
+    sizeof(Synth),
+    0,
+    NULL,
+    chorus_port_descriptor,
+    chorus_construct,
+    modulation_connect,
+    NULL,
+    chorus_process,
+    modulation_destroy
+};
+
+static const Methcla_SynthDef flangerDescriptor =
+{
+    METHCLA_PLUGINS_FLANGER_URI,
+    sizeof(Synth),
+    0,
+    NULL,
+    flanger_port_descriptor,
+    flanger_construct,
+    modulation_connect,
+    NULL,
+    flanger_process,
+    modulation_destroy
+};
+
+} // namespace modulation
+
+static const Methcla_Library library = { NULL, NULL };
+
+METHCLA_EXPORT const Methcla_Library* methcla_plugins_moddelay(const Methcla_Host* host, const char* /* bundlePath */)
+{
+    build_sinc_table();
+    methcla_host_register_synthdef(host, &moddelay::descriptor);
+    methcla_host_register_synthdef(host, &modulation::chorusDescriptor);
+    methcla_host_register_synthdef(host, &modulation::flangerDescriptor);
+    return &library;
+}
@@ -0,0 +1,228 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <methcla/plugins/multitap.h>
+
+#include <algorithm>
+#include <iostream>
+#include <oscpp/server.hpp>
+#include <unistd.h>
+#include <math.h>
+#include <string.h>
+#include "delayline.hpp"
+#include "nrtbuffer.hpp"
+
+#define PI 3.141592653589793
+
+// Multi-tap delay with a mono input and a stereo output.
+//
+// Options: maxDelay (seconds), numTaps (1-16)
+//
+// Each tap has three control ports, time (seconds), gain and pan (-1..1),
+// which come first in tap order, followed by the input and the two outputs.
+// All taps read from one circular buffer, which is written once per block;
+// every tap is then a contiguous block read mixed into both outputs.
+
+static const size_t kMultiTapMaxTaps = 16;
+
+typedef enum {
+    kMultiTap_time,
+    kMultiTap_gain,
+    kMultiTap_pan,
+    kMultiTapTapPorts
+} TapPortIndex;
+
+typedef enum {
+    kMultiTap_input_0,
+    kMultiTap_output_0,
+    kMultiTap_output_1,
+    kMultiTapAudioPorts
+} AudioPortIndex;
+
+// Synth Struct, size of Synth ist dieses Struct
+typedef struct {
+    float* ports[kMultiTapMaxTaps * kMultiTapTapPorts + kMultiTapAudioPorts];
+    size_t numTaps;
+    DelayLine delay;
+    NRTBufferRequest* request;
+    float* tapBuf;
+    float sampleRate;
+    float maxDelay;
+} Synth;
+
+struct Options {
+    float maxDelay;
+    size_t numTaps;
+};
+
+extern "C" {
+
+static bool
+port_descriptor( const Methcla_SynthOptions* inOptions
+               , Methcla_PortCount index
+               , Methcla_PortDescriptor* port )
+{
+    const Options* options = (const Options*)inOptions;
+    const size_t numTapPorts = options->numTaps * kMultiTapTapPorts;
+
+    if (index < numTapPorts) {
+        port->type = kMethcla_ControlPort;
+        port->direction = kMethcla_Input;
+        port->flags = kMethcla_PortFlags;
+        return true;
+    }
+    switch (index - numTapPorts) {
+        case kMultiTap_input_0:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kMultiTap_output_0:
+        case kMultiTap_output_1:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Output;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void
+configure(const void* tags, size_t tags_size, const void* args, size_t args_size, Methcla_SynthOptions* outOptions)
+{
+    OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
+    Options* options = (Options*)outOptions;
+    options->maxDelay = argStream.tag() == 'i' ? argStream.int32() : argStream.float32();
+    const int numTaps = argStream.atEnd() ? 1 : argStream.int32();
+    options->numTaps = std::min(kMultiTapMaxTaps, (size_t)std::max(1, numTaps));
+}
+
+static void
+set_buffer(const Methcla_World* world, Methcla_Synth* synth, float* buffer)
+{
+    Synth* self = (Synth*)synth;
+    self->request = NULL;
+    self->delay.buffer = buffer;
+}
+
+static void
+construct( const Methcla_World* world
+         , const Methcla_SynthDef* /* synthDef */
+         , const Methcla_SynthOptions* inOptions
+         , Methcla_Synth* synth )
+{
+    const Options* options = (const Options*)inOptions;
+    Synth* self = (Synth*)synth;
+    const size_t blockSize = methcla_world_block_size(world);
+
+    self->numTaps = options->numTaps;
+    self->sampleRate = methcla_world_samplerate(world);
+    self->maxDelay = options->maxDelay;
+    self->tapBuf = (float*)methcla_world_alloc(world, blockSize * sizeof(float));
+
+    const size_t maxSamples = ceil(self->maxDelay*self->sampleRate);
+    const size_t size = delayline_size(maxSamples, blockSize);
+    delayline_init(&self->delay, NULL, size);
+    self->request = nrtbuffer_request(world, synth, size + 1, set_buffer);
+}
+
+static void
+connect( Methcla_Synth* synth
+       , Methcla_PortCount index
+       , void* data )
+{
+    ((Synth*)synth)->ports[index] = (float*)data;
+}
+
+static void
+process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+    float* const* audio = self->ports + self->numTaps * kMultiTapTapPorts;
+    const float* in = audio[kMultiTap_input_0];
+    float* outL = audio[kMultiTap_output_0];
+    float* outR = audio[kMultiTap_output_1];
+    DelayLine* delay = &self->delay;
+
+    if (delay->buffer == NULL) {
+        memset(outL, 0, numFrames * sizeof(float));
+        memset(outR, 0, numFrames * sizeof(float));
+        return;
+    }
+
+    // Write first, so that taps shorter than a block can read this block
+    delayline_write_block(delay, in, numFrames);
+
+    memset(outL, 0, numFrames * sizeof(float));
+    memset(outR, 0, numFrames * sizeof(float));
+
+    const float mdt = floorf(self->maxDelay*self->sampleRate);
+    float* tap = self->tapBuf;
+
+    for (size_t i = 0; i < self->numTaps; i++) {
+        float* const* ports = self->ports + i * kMultiTapTapPorts;
+        const float time = *ports[kMultiTap_time];
+        const float gain = *ports[kMultiTap_gain];
+        const float pan = std::max(-1.f, std::min(1.f, *ports[kMultiTap_pan]));
+
+        if (gain == 0.f) continue;
+
+        // equal power panning
+        const float angle = (pan + 1.f) * (PI / 4.);
+        const float gainL = gain * cos(angle);
+        const float gainR = gain * sin(angle);
+
+        const float vdt = std::max(1.f, std::min(time*self->sampleRate, mdt));
+        delayline_read_block(delay, tap, numFrames, vdt);
+
+        for (size_t k = 0; k < numFrames; k++) {
+            outL[k] += gainL * tap[k];
+            outR[k] += gainR * tap[k];
+        }
+    }
+}
+
+} // extern "C"
+
+static void
+destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    nrtbuffer_cancel(self->request);
+    nrtbuffer_free(world, self->delay.buffer);
+    methcla_world_free(world, self->tapBuf);
+}
+
+static const Methcla_SynthDef descriptor =
+{
+    METHCLA_PLUGINS_MULTITAP_URI,
+    sizeof(Synth),
+    sizeof(Options),
+    configure,
+    port_descriptor,
+    construct,
+    connect,
+    NULL,
+    process,
+    destroy
+};
+
+static const Methcla_Library library = { NULL, NULL };
+
+METHCLA_EXPORT const Methcla_Library* methcla_plugins_multitap(const Methcla_Host* host, const char* /* bundlePath */)
+{
+    methcla_host_register_synthdef(host, &descriptor);
+    return &library;
+}
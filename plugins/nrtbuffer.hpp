@@ -0,0 +1,100 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef METHCLA_PLUGINS_NRTBUFFER_HPP_INCLUDED
+#define METHCLA_PLUGINS_NRTBUFFER_HPP_INCLUDED
+
+#include <methcla/plugin.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+// Allocation of large sample buffers on the non-realtime side.
+//
+// A synth requests a buffer in construct. The buffer is allocated and zeroed
+// (which also faults in its pages) in a host command and handed to the synth
+// in a world command, i.e. at a block boundary. Until then the synth has to
+// run without it; if the allocation fails the callback receives NULL.
+//
+// When the synth is destroyed before the buffer has arrived, destroy has to
+// cancel the request and the buffer is returned to the host on arrival.
+// Installed buffers are released with nrtbuffer_free.
+
+typedef void (*NRTBufferCallback)(const Methcla_World* world, Methcla_Synth* synth, float* buffer);
+
+struct NRTBufferRequest
+{
+    Methcla_Synth* synth;   // NULL when cancelled
+    NRTBufferCallback callback;
+    size_t size;
+    float* buffer;
+};
+
+static void
+nrtbuffer_host_free(const Methcla_Host* /* host */, void* data)
+{
+    free(data);
+}
+
+static void
+nrtbuffer_world_install(const Methcla_World* world, void* data)
+{
+    NRTBufferRequest* request = (NRTBufferRequest*)data;
+    if (request->synth != NULL) {
+        request->callback(world, request->synth, request->buffer);
+    } else if (request->buffer != NULL) {
+        methcla_world_perform_command(world, nrtbuffer_host_free, request->buffer);
+    }
+    methcla_world_free(world, request);
+}
+
+static void
+nrtbuffer_host_alloc(const Methcla_Host* host, void* data)
+{
+    NRTBufferRequest* request = (NRTBufferRequest*)data;
+    request->buffer = (float*)malloc(request->size * sizeof(float));
+    if (request->buffer != NULL) {
+        memset(request->buffer, 0, request->size * sizeof(float));
+    }
+    methcla_host_perform_command(host, nrtbuffer_world_install, request);
+}
+
+// Request a zeroed buffer of size floats. The callback runs in the realtime
+// context; the returned request is only valid until then.
+inline NRTBufferRequest*
+nrtbuffer_request(const Methcla_World* world, Methcla_Synth* synth, size_t size, NRTBufferCallback callback)
+{
+    NRTBufferRequest* request = (NRTBufferRequest*)methcla_world_alloc(world, sizeof(NRTBufferRequest));
+    if (request == NULL) return NULL;
+    request->synth = synth;
+    request->callback = callback;
+    request->size = size;
+    request->buffer = NULL;
+    methcla_world_perform_command(world, nrtbuffer_host_alloc, request);
+    return request;
+}
+
+inline void
+nrtbuffer_cancel(NRTBufferRequest* request)
+{
+    if (request != NULL) request->synth = NULL;
+}
+
+inline void
+nrtbuffer_free(const Methcla_World* world, float* buffer)
+{
+    if (buffer != NULL) methcla_world_perform_command(world, nrtbuffer_host_free, buffer);
+}
+
+#endif // METHCLA_PLUGINS_NRTBUFFER_HPP_INCLUDED
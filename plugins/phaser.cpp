@@ -0,0 +1,243 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <methcla/plugins/phaser.h>
+
+#include <algorithm>
+#include <iostream>
+#include <oscpp/server.hpp>
+#include <unistd.h>
+#include <math.h>
+
+#define PI 3.141592653589793
+#define TWOPI 6.283185307179586
+
+// Allpass phaser.
+//
+// Options: [numStages (4-12, default 6)], [numChannels (1 or 2, default 1)]
+//
+// The LFO sweeps the allpass break frequency freq by up to two octaves up and
+// down (scaled by depth), kept between kPhaserMinFreq and 0.45 times the
+// sample rate; in stereo mode the right channel's LFO runs 90 degrees ahead.
+// Stage coefficients are updated every kPhaserSubBlock samples. The stage
+// state is interleaved by channel, so in stereo mode both channels go through
+// the cascade together.
+
+static const int kPhaserMinStages = 4;
+static const int kPhaserMaxStages = 12;
+static const int kPhaserMaxChannels = 2;
+static const size_t kPhaserSubBlock = 16;
+static const float kPhaserMinFreq = 10.f;
+
+typedef enum {
+    kPhaser_rate,
+    kPhaser_depth,
+    kPhaser_fb,
+    kPhaser_freq,
+    kPhaser_input_0,
+    kPhaser_output_0,
+    kPhaserPorts
+} PortIndex;
+
+// Synth Struct, size of Synth ist dieses Struct
+typedef struct {
+    float* ports[kPhaser_input_0 + 2 * kPhaserMaxChannels];
+    int numStages;
+    int numChannels;
+    double sampleRate;
+    double lfoPhase;
+    float z[kPhaserMaxStages][kPhaserMaxChannels];
+    float last[kPhaserMaxChannels];
+} Synth;
+
+struct Options {
+    int numStages;
+    int numChannels;
+};
+
+template <int C>
+static void
+process_channels(Synth* self, float* const* in, float* const* out, size_t numFrames)
+{
+    const float rate = *self->ports[kPhaser_rate];
+    const float depth = *self->ports[kPhaser_depth];
+    const float fb = std::max(-0.95f, std::min(0.95f, *self->ports[kPhaser_fb]));
+    const float freq = *self->ports[kPhaser_freq];
+    const int numStages = self->numStages;
+    const double sampleRate = self->sampleRate;
+    const double lfoInc = TWOPI * rate / sampleRate;
+    const float maxFreq = 0.45f * sampleRate;
+
+    float z[kPhaserMaxStages][C];
+    float last[C];
+    for (int s = 0; s < numStages; s++) {
+        for (int c = 0; c < C; c++) z[s][c] = self->z[s][c];
+    }
+    for (int c = 0; c < C; c++) last[c] = self->last[c];
+
+    double lfoPhase = self->lfoPhase;
+
+    for (size_t k0 = 0; k0 < numFrames; k0 += kPhaserSubBlock) {
+        const size_t k1 = std::min(numFrames, k0 + kPhaserSubBlock);
+
+        // Stage coefficient for this sub-block, one per channel
+        float a[C];
+        for (int c = 0; c < C; c++) {
+            const float lfo = sin(lfoPhase + c * (PI / 2.));
+            // Above 0 Hz, or the stages' |a| reaches 1 and the cascade is unstable
+            const float f = std::max(kPhaserMinFreq, std::min(maxFreq, freq * powf(2.f, 2.f * depth * lfo)));
+            const float t = tan(PI * f / sampleRate);
+            a[c] = (t - 1.f) / (t + 1.f);
+        }
+        lfoPhase += lfoInc * (k1 - k0);
+
+        for (size_t k = k0; k < k1; k++) {
+            float x[C], dry[C];
+            for (int c = 0; c < C; c++) {
+                dry[c] = in[c][k];
+                x[c] = dry[c] + fb * last[c];
+            }
+            for (int s = 0; s < numStages; s++) {
+                for (int c = 0; c < C; c++) {
+                    const float y = a[c] * x[c] + z[s][c];
+                    z[s][c] = x[c] - a[c] * y;
+                    x[c] = y;
+                }
+            }
+            for (int c = 0; c < C; c++) {
+                last[c] = x[c];
+                out[c][k] = 0.5f * (dry[c] + x[c]);
+            }
+        }
+    }
+
+    self->lfoPhase = fmod(lfoPhase, TWOPI);
+    for (int s = 0; s < numStages; s++) {
+        for (int c = 0; c < C; c++) self->z[s][c] = z[s][c];
+    }
+    for (int c = 0; c < C; c++) self->last[c] = last[c];
+}
+
+extern "C" {
+
+static bool
+port_descriptor( const Methcla_SynthOptions* inOptions
+               , Methcla_PortCount index
+               , Methcla_PortDescriptor* port )
+{
+    const Options* options = (const Options*)inOptions;
+    const size_t numChannels = options->numChannels;
+
+    if (index < kPhaser_input_0) {
+        port->type = kMethcla_ControlPort;
+        port->direction = kMethcla_Input;
+        port->flags = kMethcla_PortFlags;
+        return true;
+    }
+    else if (index < kPhaser_input_0 + numChannels) {
+        port->type = kMethcla_AudioPort;
+        port->direction = kMethcla_Input;
+        port->flags = kMethcla_PortFlags;
+        return true;
+    }
+    else if (index < kPhaser_input_0 + 2 * numChannels) {
+        port->type = kMethcla_AudioPort;
+        port->direction = kMethcla_Output;
+        port->flags = kMethcla_PortFlags;
+        return true;
+    }
+    else {
+        return false;
+    }
+}
+
+static void
+configure(const void* tags, size_t tags_size, const void* args, size_t args_size, Methcla_SynthOptions* outOptions)
+{
+    OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
+    Options* options = (Options*)outOptions;
+    const int numStages = argStream.atEnd() ? 6 : argStream.int32();
+    const int numChannels = argStream.atEnd() ? 1 : argStream.int32();
+    options->numStages = std::max(kPhaserMinStages, std::min(kPhaserMaxStages, numStages));
+    options->numChannels = std::max(1, std::min(kPhaserMaxChannels, numChannels));
+}
+
+static void
+construct( const Methcla_World* world
+         , const Methcla_SynthDef* /* synthDef */
+         , const Methcla_SynthOptions* inOptions
+         , Methcla_Synth* synth )
+{
+    const Options* options = (const Options*)inOptions;
+    Synth* self = (Synth*)synth;
+    self->numStages = options->numStages;
+    self->numChannels = options->numChannels;
+    self->sampleRate = methcla_world_samplerate(world);
+    self->lfoPhase = 0.;
+    for (int s = 0; s < kPhaserMaxStages; s++) {
+        for (int c = 0; c < kPhaserMaxChannels; c++) {
+            self->z[s][c] = 0.f;
+        }
+    }
+    for (int c = 0; c < kPhaserMaxChannels; c++) {
+        self->last[c] = 0.f;
+    }
+}
+
+static void
+connect( Methcla_Synth* synth
+       , Methcla_PortCount index
+       , void* data )
+{
+    ((Synth*)synth)->ports[index] = (float*)data;
+}
+
+static void
+process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+    float* const* in = self->ports + kPhaser_input_0;
+    float* const* out = in + self->numChannels;
+
+    if (self->numChannels == 2) {
+        process_channels<2>(self, in, out, numFrames);
+    } else {
+        process_channels<1>(self, in, out, numFrames);
+    }
+}
+
+} // extern "C"
+
+
+static const Methcla_SynthDef descriptor =
+{
+    METHCLA_PLUGINS_PHASER_URI,
+    sizeof(Synth),
+    sizeof(Options),
+    configure,
+    port_descriptor,
+    construct,
+    connect,
+    NULL,
+    process,
+    NULL
+};
+
+static const Methcla_Library library = { NULL, NULL };
+
+METHCLA_EXPORT const Methcla_Library* methcla_plugins_phaser(const Methcla_Host* host, const char* /* bundlePath */)
+{
+    methcla_host_register_synthdef(host, &descriptor);
+    return &library;
+}
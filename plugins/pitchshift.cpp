@@ -0,0 +1,227 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <methcla/plugins/pitchshift.h>
+
+#include <algorithm>
+#include <iostream>
+#include <oscpp/server.hpp>
+#include <unistd.h>
+#include <math.h>
+#include <string.h>
+#include "delayline.hpp"
+#include "nrtbuffer.hpp"
+
+#define TWOPI 6.283185307179586
+
+// Time domain pitch shifter.
+//
+// Options: [windowSize (seconds, default 0.04)]
+//
+// Two read heads sweep through a delay line at the rate that gives the
+// requested pitch ratio, half a window apart. Whenever a head wraps around it
+// is faded out by a Hann window, while the other one is at full gain; the two
+// windows sum to one. Per sample this is two interpolated reads and two table
+// lookups.
+//
+// The average delay, half the window, is the latency of the shifter. It is
+// written to the latency control output in seconds; smaller windows reduce
+// the latency at the expense of more audible grain modulation on low notes.
+
+static const float kPitchShiftDefaultWindow = 0.04f;
+static const float kPitchShiftMinWindow = 0.005f;
+static const float kPitchShiftMaxWindow = 0.2f;
+static const float kPitchShiftMaxRatio = 4.f;
+
+// Hann window over one grain, shared by all instances
+static const size_t kWindowTableSize = 1024;
+static float windowTable[kWindowTableSize + 1];
+
+typedef enum {
+    kPitchShift_ratio,
+    kPitchShift_latency,
+    kPitchShift_input_0,
+    kPitchShift_output_0,
+    kPitchShiftPorts
+} PortIndex;
+
+// Synth Struct, size of Synth ist dieses Struct
+typedef struct {
+    float* ports[kPitchShiftPorts];
+    DelayLine delay;
+    NRTBufferRequest* request;
+    float samplerate;
+    float window;       // samples
+    float phase;        // position of the first head within the window, 0-1
+} Synth;
+
+struct Options {
+    float window;
+};
+
+extern "C" {
+
+static bool
+port_descriptor( const Methcla_SynthOptions* /* options */
+               , Methcla_PortCount index
+               , Methcla_PortDescriptor* port )
+{
+    switch ((PortIndex)index) {
+        case kPitchShift_ratio:
+            port->type = kMethcla_ControlPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kPitchShift_latency:
+            port->type = kMethcla_ControlPort;
+            port->direction = kMethcla_Output;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kPitchShift_input_0:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kPitchShift_output_0:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Output;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void
+configure(const void* tags, size_t tags_size, const void* args, size_t args_size, Methcla_SynthOptions* outOptions)
+{
+    OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
+    Options* options = (Options*)outOptions;
+    const float window = argStream.atEnd() ? kPitchShiftDefaultWindow
+                       : argStream.tag() == 'i' ? argStream.int32() : argStream.float32();
+    options->window = std::max(kPitchShiftMinWindow, std::min(window, kPitchShiftMaxWindow));
+}
+
+static void
+set_buffer(const Methcla_World* world, Methcla_Synth* synth, float* buffer)
+{
+    Synth* self = (Synth*)synth;
+    self->request = NULL;
+    self->delay.buffer = buffer;
+}
+
+static void
+construct( const Methcla_World* world
+         , const Methcla_SynthDef* /* synthDef */
+         , const Methcla_SynthOptions* inOptions
+         , Methcla_Synth* synth )
+{
+    const Options* options = (const Options*)inOptions;
+    Synth* self = (Synth*)synth;
+
+    self->samplerate = methcla_world_samplerate(world);
+    self->window = floorf(options->window * self->samplerate);
+    self->phase = 0.f;
+
+    const size_t size = delayline_size(self->window + 2, methcla_world_block_size(world));
+    delayline_init(&self->delay, NULL, size);
+    self->request = nrtbuffer_request(world, synth, size + 1, set_buffer);
+}
+
+static void
+connect( Methcla_Synth* synth
+       , Methcla_PortCount index
+       , void* data )
+{
+    ((Synth*)synth)->ports[index] = (float*)data;
+}
+
+static void
+process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+
+    const float ratio = std::max(0.f, std::min(*self->ports[kPitchShift_ratio], kPitchShiftMaxRatio));
+    const float* in = self->ports[kPitchShift_input_0];
+    float* out = self->ports[kPitchShift_output_0];
+    DelayLine* delay = &self->delay;
+
+    *self->ports[kPitchShift_latency] = 0.5f * self->window / self->samplerate;
+
+    if (delay->buffer == NULL) {
+        memset(out, 0, numFrames * sizeof(float));
+        return;
+    }
+
+    const float window = self->window;
+    // The delay grows by 1 - ratio samples per sample
+    const float inc = (1.f - ratio) / window;
+    float phase = self->phase;
+
+    for (size_t k = 0; k < numFrames; k++) {
+        float phase2 = phase + 0.5f;
+        if (phase2 >= 1.f) phase2 -= 1.f;
+
+        const float g1 = windowTable[(size_t)(phase * kWindowTableSize)];
+        const float g2 = windowTable[(size_t)(phase2 * kWindowTableSize)];
+
+        // Read before writing, so that the shortest delay is one sample
+        const float o = g1 * delayline_read(delay, 1.f + phase * window)
+                      + g2 * delayline_read(delay, 1.f + phase2 * window);
+        delayline_write(delay, in[k]);
+        out[k] = o;
+
+        phase += inc;
+        if (phase >= 1.f) phase -= 1.f;
+        else if (phase < 0.f) phase += 1.f;
+    }
+
+    self->phase = phase;
+}
+
+} // extern "C"
+
+static void
+destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    nrtbuffer_cancel(self->request);
+    nrtbuffer_free(world, self->delay.buffer);
+}
+
+static const Methcla_SynthDef descriptor =
+{
+    METHCLA_PLUGINS_PITCHSHIFT_URI,
+    sizeof(Synth),
+    sizeof(Options),
+    configure,
+    port_descriptor,
+    construct,
+    connect,
+    NULL,
+    process,
+    destroy
+};
+
+static const Methcla_Library library = { NULL, NULL };
+
+METHCLA_EXPORT const Methcla_Library* methcla_plugins_pitchshift(const Methcla_Host* host, const char* /* bundlePath */)
+{
+    // Zero at both ends of the grain, where a head jumps
+    for (size_t i = 0; i <= kWindowTableSize; i++) {
+        windowTable[i] = 0.5f - 0.5f * cos(TWOPI * i / kWindowTableSize);
+    }
+    methcla_host_register_synthdef(host, &descriptor);
+    return &library;
+}
@@ -0,0 +1,245 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <methcla/plugins/pluck.h>
+
+#include <algorithm>
+#include <iostream>
+#include <oscpp/server.hpp>
+#include <unistd.h>
+#include <math.h>
+#include <string.h>
+#include "delayline.hpp"
+
+// Karplus-Strong plucked string.
+//
+// Options: [minFreq (Hz, default 20)]
+//
+// The excitation input is fed into a loop of an integer delay line, a
+// two-point damping filter and a first order allpass, which supplies the
+// fractional part of the period so that high notes stay in tune:
+//
+//   loop delay = N + damp/2 + allpass delay = samplerate / freq
+//
+// decay is the T60 time in seconds, damp (0-1) the high frequency loss per
+// period. The loop is a few multiply-adds per sample and the whole string is
+// a single node.
+//
+// The delay line holds one period at minFreq, at most a few kilobytes, and is
+// taken from the world allocator so that a string can be excited in its first
+// block.
+
+static const float kPluckDefaultMinFreq = 20.f;
+
+typedef enum {
+    kPluck_freq,
+    kPluck_decay,
+    kPluck_damp,
+    kPluck_input_0,
+    kPluck_output_0,
+    kPluckPorts
+} PortIndex;
+
+// Synth Struct, size of Synth ist dieses Struct
+typedef struct {
+    float* ports[kPluckPorts];
+    DelayLine delay;
+    float samplerate;
+    float minFreq;
+    // Control values the coefficients were computed for
+    float freq;
+    float decay;
+    float damp;
+    // Loop coefficients
+    size_t period;      // integer delay
+    float gain;
+    float lp;           // damping filter: (1 - lp) x[n] + lp x[n-1]
+    float eta;          // allpass coefficient
+    // Filter state
+    float lp1;
+    float ap_x1;
+    float ap_y1;
+} Synth;
+
+struct Options {
+    float minFreq;
+};
+
+extern "C" {
+
+static bool
+port_descriptor( const Methcla_SynthOptions* /* options */
+               , Methcla_PortCount index
+               , Methcla_PortDescriptor* port )
+{
+    switch ((PortIndex)index) {
+        case kPluck_freq:
+        case kPluck_decay:
+        case kPluck_damp:
+            port->type = kMethcla_ControlPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kPluck_input_0:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kPluck_output_0:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Output;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void
+configure(const void* tags, size_t tags_size, const void* args, size_t args_size, Methcla_SynthOptions* outOptions)
+{
+    OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
+    Options* options = (Options*)outOptions;
+    options->minFreq = argStream.atEnd() ? kPluckDefaultMinFreq
+                     : argStream.tag() == 'i' ? argStream.int32() : argStream.float32();
+    options->minFreq = std::max(1.f, options->minFreq);
+}
+
+static void
+construct( const Methcla_World* world
+         , const Methcla_SynthDef* /* synthDef */
+         , const Methcla_SynthOptions* inOptions
+         , Methcla_Synth* synth )
+{
+    const Options* options = (const Options*)inOptions;
+    Synth* self = (Synth*)synth;
+
+    self->samplerate = methcla_world_samplerate(world);
+    self->minFreq = options->minFreq;
+    self->freq = -1;
+    self->decay = -1;
+    self->damp = -1;
+    self->lp1 = 0.f;
+    self->ap_x1 = 0.f;
+    self->ap_y1 = 0.f;
+
+    const size_t size = delayline_size(ceil(self->samplerate / self->minFreq), 0);
+    float* buffer = (float*)methcla_world_alloc(world, (size + 1) * sizeof(float));
+    memset(buffer, 0, (size + 1) * sizeof(float));
+    delayline_init(&self->delay, buffer, size);
+}
+
+static void
+connect( Methcla_Synth* synth
+       , Methcla_PortCount index
+       , void* data )
+{
+    ((Synth*)synth)->ports[index] = (float*)data;
+}
+
+static void
+update_coeffs(Synth* self, float freq, float decay, float damp)
+{
+    const float f = std::max(self->minFreq, std::min(freq, 0.25f * self->samplerate));
+    const float d = std::max(0.f, std::min(damp, 1.f));
+    const float loop = self->samplerate / f;
+
+    self->lp = 0.5f * d;
+
+    // Allpass delay in [0.5, 1.5) for a well-behaved coefficient
+    const float rest = loop - self->lp;
+    const size_t n = std::max(1.f, floorf(rest - 0.5f));
+    const float frac = rest - n;
+    self->period = n;
+    self->eta = (1.f - frac) / (1.f + frac);
+
+    // -60 dB after decay seconds, i.e. f * decay periods
+    self->gain = decay > 0.f ? powf(0.001f, 1.f / (f * decay)) : 0.f;
+
+    self->freq = freq;
+    self->decay = decay;
+    self->damp = damp;
+}
+
+static void
+process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+
+    const float freq = *self->ports[kPluck_freq];
+    const float decay = *self->ports[kPluck_decay];
+    const float damp = *self->ports[kPluck_damp];
+    const float* in = self->ports[kPluck_input_0];
+    float* out = self->ports[kPluck_output_0];
+
+    if (freq != self->freq || decay != self->decay || damp != self->damp) {
+        update_coeffs(self, freq, decay, damp);
+    }
+
+    DelayLine* delay = &self->delay;
+    const size_t period = self->period;
+    const float gain = self->gain;
+    const float lp = self->lp;
+    const float eta = self->eta;
+    float lp1 = self->lp1;
+    float ap_x1 = self->ap_x1;
+    float ap_y1 = self->ap_y1;
+
+    for (size_t k = 0; k < numFrames; k++) {
+        const float x = delayline_tap(delay, period);
+        const float v = x + lp * (lp1 - x);
+        lp1 = x;
+        const float w = eta * (v - ap_y1) + ap_x1;
+        ap_x1 = v;
+        ap_y1 = w;
+        const float y = in[k] + gain * w;
+        delayline_write(delay, y);
+        out[k] = y;
+    }
+
+    self->lp1 = lp1;
+    self->ap_x1 = ap_x1;
+    self->ap_y1 = ap_y1;
+}
+
+} // extern "C"
+
+static void
+destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    methcla_world_free(world, self->delay.buffer);
+}
+
+static const Methcla_SynthDef descriptor =
+{
+    METHCLA_PLUGINS_PLUCK_URI,
+    sizeof(Synth),
+    sizeof(Options),
+    configure,
+    port_descriptor,
+    construct,
+    connect,
+    NULL,
+    process,
+    destroy
+};
+
+static const Methcla_Library library = { NULL, NULL };
+
+METHCLA_EXPORT const Methcla_Library* methcla_plugins_pluck(const Methcla_Host* host, const char* /* bundlePath */)
+{
+    methcla_host_register_synthdef(host, &descriptor);
+    return &library;
+}
@@ -18,9 +18,10 @@
 #include <oscpp/server.hpp>
 #include <unistd.h>
 #include <math.h>
+#include <new>
+#include <string.h>
 #include "freeverb/revmodel.hpp"
-
-revmodel model;
+#include "silence.hpp"
 
 typedef enum {
     kReverb_room,
@@ -39,6 +40,16 @@ typedef enum {
 typedef struct 
 {
     float* ports[kReverbPorts];
+    revmodel model;
+    float* buffers;
+    SilenceTracker silence;
+    // Set until the first block has passed the controls to the model
+    bool first;
+    // Control values last passed to the model
+    float room;
+    float damp;
+    float wet;
+    float dry;
 } Synth;
 
 extern "C" {
@@ -81,6 +92,18 @@ construct( const Methcla_World* world
          , Methcla_Synth* synth )
 {
     Synth* self = (Synth*)synth;
+    const float samplerate = methcla_world_samplerate(world);
+    new (&self->model) revmodel();
+    // Delay lengths scaled from the 44.1 kHz tuning, see reverb.h
+    self->buffers = (float*)methcla_world_alloc(world, revmodel::buffersize(samplerate) * sizeof(float));
+    self->model.setbuffers(self->buffers, samplerate);
+    // Bounded by the total length of all delay lines
+    silence_init(&self->silence, revmodel::buffersize(samplerate));
+    self->first = true;
+    self->room = 0.f;
+    self->damp = 0.f;
+    self->wet = 0.f;
+    self->dry = 0.f;
 }
 
 static void
@@ -107,28 +130,67 @@ process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
     const float wet = *self->ports[kReverb_wet];
     const float dry = *self->ports[kReverb_dry];
 
-    model.setroomsize(room);
-    model.setdamp(damp);
-    model.setwet(wet);
-    model.setdry(dry);
+    // Only changed controls reach the model. The first values apply at once,
+    // later changes are ramped across the block by the model.
+    revmodel& model = self->model;
+    const bool first = self->first;
+    self->first = false;
+    model.setsmoothing(!first);
+    if (first || room != self->room) {
+        model.setroomsize(room);
+        self->room = room;
+    }
+    if (first || damp != self->damp) {
+        model.setdamp(damp);
+        self->damp = damp;
+    }
+    if (first || wet != self->wet) {
+        model.setwet(wet);
+        self->wet = wet;
+    }
+    if (first || dry != self->dry) {
+        model.setdry(dry);
+        self->dry = dry;
+    }
+
+    const bool inputSilent = silence_check(in_L, numFrames) && silence_check(in_R, numFrames);
+    if (silence_skip(&self->silence, inputSilent)) {
+        memset(out_L, 0, numFrames * sizeof(float));
+        memset(out_R, 0, numFrames * sizeof(float));
+        return;
+    }
+
     model.processreplace(in_L, in_R, out_L, out_R, numFrames, 1);
+
+    const bool outputSilent = silence_check(out_L, numFrames) && silence_check(out_R, numFrames);
+    if (silence_update(&self->silence, inputSilent, outputSilent, numFrames)) {
+        // Flush the inaudible remainder, so that it cannot turn denormal
+        model.mute();
+    }
 }
 
 } // extern "C"
 
+static void
+destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    self->model.~revmodel();
+    methcla_world_free(world, self->buffers);
+}
 
 static const Methcla_SynthDef descriptor =
 {
     METHCLA_PLUGINS_REVERB_URI,
     sizeof(Synth),
-    NULL, 
+    0,
     NULL,
     port_descriptor,
     construct,
     connect,
     NULL,
     process,
-    NULL
+    destroy
 };
 
 static const Methcla_Library library = { NULL, NULL };
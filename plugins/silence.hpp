@@ -0,0 +1,91 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef METHCLA_PLUGINS_SILENCE_HPP_INCLUDED
+#define METHCLA_PLUGINS_SILENCE_HPP_INCLUDED
+
+#include <math.h>
+#include <stddef.h>
+
+// Skipping of blocks in which a plugin with a tail would only compute
+// silence.
+//
+// After its input falls silent a reverb, delay or filter keeps ringing out of
+// its internal state. The tracker counts the samples over which input and
+// output both stayed below kSilenceThreshold. Once that span covers the
+// plugin's memory, i.e. the longest time a sample can stay inside it without
+// reaching the output, nothing audible is left and further silent input
+// blocks are answered with zeros instead of running the full loops.
+//
+//   const bool inputSilent = silence_check(in, numFrames);
+//   if (silence_skip(&self->silence, inputSilent)) {
+//       // zero the outputs and return
+//   }
+//   // process
+//   if (silence_update(&self->silence, inputSilent, silence_check(out, numFrames), numFrames)) {
+//       // optionally clear the residual state
+//   }
+
+static const float kSilenceThreshold = 1e-5f;   // -100 dB
+
+struct SilenceTracker
+{
+    size_t memory;  // samples
+    size_t quiet;   // samples of silent input and output so far
+};
+
+inline void silence_init(SilenceTracker* s, size_t memory)
+{
+    s->memory = memory;
+    s->quiet = 0;
+}
+
+// True if no sample exceeds the threshold. Returns at the first one that
+// does, so audible blocks cost next to nothing.
+inline bool silence_check(const float* x, size_t numFrames)
+{
+    for (size_t k = 0; k < numFrames; k++) {
+        if (fabsf(x[k]) > kSilenceThreshold) return false;
+    }
+    return true;
+}
+
+inline bool silence_check_channels(float* const* x, size_t numChannels, size_t numFrames)
+{
+    for (size_t c = 0; c < numChannels; c++) {
+        if (!silence_check(x[c], numFrames)) return false;
+    }
+    return true;
+}
+
+// True if the block can be skipped.
+inline bool silence_skip(const SilenceTracker* s, bool inputSilent)
+{
+    return inputSilent && s->quiet >= s->memory;
+}
+
+// Account for a processed block. Returns true for the block that completes
+// the decay, after which the plugin may clear its state.
+inline bool silence_update(SilenceTracker* s, bool inputSilent, bool outputSilent, size_t numFrames)
+{
+    if (!inputSilent || !outputSilent) {
+        s->quiet = 0;
+        return false;
+    }
+    const bool decayed = s->quiet < s->memory && s->quiet + numFrames >= s->memory;
+    s->quiet += numFrames;
+    return decayed;
+}
+
+#endif // METHCLA_PLUGINS_SILENCE_HPP_INCLUDED
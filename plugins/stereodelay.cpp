@@ -0,0 +1,228 @@
+// Copyright 2012-2013 Samplecount S.L.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <methcla/plugins/stereodelay.h>
+
+#include <algorithm>
+#include <iostream>
+#include <oscpp/server.hpp>
+#include <unistd.h>
+#include <math.h>
+#include <string.h>
+#include "delayline.hpp"
+#include "nrtbuffer.hpp"
+
+// Stereo delay with a feedback matrix.
+//
+// Options: maxDelay (seconds)
+//
+// Each channel has its own delay time. The delayed signals are fed back
+// through a 2x2 matrix, fb_lr being the amount of the left output written into
+// the right line; fb_ll = fb_rr = 0 with fb_lr = fb_rl > 0 gives a ping-pong
+// delay. The feedback stays inside the node, without a block of bus latency.
+//
+// Both lines share one interleaved buffer of left/right frames, so the reads
+// and writes of a sample touch adjacent memory.
+
+typedef enum {
+    kStereoDelay_time_l,
+    kStereoDelay_time_r,
+    kStereoDelay_fb_ll,
+    kStereoDelay_fb_lr,
+    kStereoDelay_fb_rl,
+    kStereoDelay_fb_rr,
+    kStereoDelay_input_0,
+    kStereoDelay_input_1,
+    kStereoDelay_output_0,
+    kStereoDelay_output_1,
+    kStereoDelayPorts
+} PortIndex;
+
+// Synth Struct, size of Synth ist dieses Struct
+typedef struct {
+    float* ports[kStereoDelayPorts];
+    float* buffer;      // 2 * size interleaved frames
+    size_t mask;        // frames
+    size_t wp;          // frames
+    NRTBufferRequest* request;
+    float sampleRate;
+    float maxDelay;
+} Synth;
+
+struct Options {
+    float maxDelay;
+};
+
+extern "C" {
+
+static bool
+port_descriptor( const Methcla_SynthOptions* /* options */
+               , Methcla_PortCount index
+               , Methcla_PortDescriptor* port )
+{
+    switch ((PortIndex)index) {
+        case kStereoDelay_time_l:
+        case kStereoDelay_time_r:
+        case kStereoDelay_fb_ll:
+        case kStereoDelay_fb_lr:
+        case kStereoDelay_fb_rl:
+        case kStereoDelay_fb_rr:
+            port->type = kMethcla_ControlPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kStereoDelay_input_0:
+        case kStereoDelay_input_1:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Input;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        case kStereoDelay_output_0:
+        case kStereoDelay_output_1:
+            port->type = kMethcla_AudioPort;
+            port->direction = kMethcla_Output;
+            port->flags = kMethcla_PortFlags;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void
+configure(const void* tags, size_t tags_size, const void* args, size_t args_size, Methcla_SynthOptions* outOptions)
+{
+    OSCPP::Server::ArgStream argStream(OSCPP::ReadStream(tags, tags_size), OSCPP::ReadStream(args, args_size));
+    Options* options = (Options*)outOptions;
+    options->maxDelay = argStream.tag() == 'i' ? argStream.int32() : argStream.float32();
+}
+
+static void
+set_buffer(const Methcla_World* world, Methcla_Synth* synth, float* buffer)
+{
+    Synth* self = (Synth*)synth;
+    self->request = NULL;
+    self->buffer = buffer;
+}
+
+static void
+construct( const Methcla_World* world
+         , const Methcla_SynthDef* /* synthDef */
+         , const Methcla_SynthOptions* inOptions
+         , Methcla_Synth* synth )
+{
+    const Options* options = (const Options*)inOptions;
+    Synth* self = (Synth*)synth;
+
+    self->sampleRate = methcla_world_samplerate(world);
+    self->maxDelay = options->maxDelay;
+
+    const size_t maxSamples = ceil(self->maxDelay*self->sampleRate);
+    const size_t size = delayline_size(maxSamples, methcla_world_block_size(world));
+    self->buffer = NULL;
+    self->mask = size - 1;
+    self->wp = 0;
+    self->request = nrtbuffer_request(world, synth, 2 * size, set_buffer);
+}
+
+static void
+connect( Methcla_Synth* synth
+       , Methcla_PortCount index
+       , void* data )
+{
+    ((Synth*)synth)->ports[index] = (float*)data;
+}
+
+static void
+process(const Methcla_World* world, Methcla_Synth* synth, size_t numFrames)
+{
+    Synth* self = (Synth*)synth;
+    const float* inL = self->ports[kStereoDelay_input_0];
+    const float* inR = self->ports[kStereoDelay_input_1];
+    float* outL = self->ports[kStereoDelay_output_0];
+    float* outR = self->ports[kStereoDelay_output_1];
+
+    if (self->buffer == NULL) {
+        memset(outL, 0, numFrames * sizeof(float));
+        memset(outR, 0, numFrames * sizeof(float));
+        return;
+    }
+
+    const float fbLL = *self->ports[kStereoDelay_fb_ll];
+    const float fbLR = *self->ports[kStereoDelay_fb_lr];
+    const float fbRL = *self->ports[kStereoDelay_fb_rl];
+    const float fbRR = *self->ports[kStereoDelay_fb_rr];
+
+    // delay times are clipped to [1, max delaytime] samples
+    const float mdt = floorf(self->maxDelay*self->sampleRate);
+    const float vdtL = std::max(1.f, std::min(*self->ports[kStereoDelay_time_l]*self->sampleRate, mdt));
+    const float vdtR = std::max(1.f, std::min(*self->ports[kStereoDelay_time_r]*self->sampleRate, mdt));
+    const size_t diL = (size_t)vdtL;
+    const size_t diR = (size_t)vdtR;
+    const float fracL = vdtL - diL;
+    const float fracR = vdtR - diR;
+
+    float* buffer = self->buffer;
+    const size_t mask = self->mask;
+    size_t w = self->wp;
+
+    for (size_t k = 0; k < numFrames; k++) {
+        // Left samples at even, right samples at odd indices
+        const float* l0 = buffer + 2 * ((w - diL) & mask);
+        const float* l1 = buffer + 2 * ((w - diL - 1) & mask);
+        const float* r0 = buffer + 2 * ((w - diR) & mask) + 1;
+        const float* r1 = buffer + 2 * ((w - diR - 1) & mask) + 1;
+        const float oL = *l0 + fracL * (*l1 - *l0);
+        const float oR = *r0 + fracR * (*r1 - *r0);
+        float* dst = buffer + 2 * w;
+        dst[0] = inL[k] + fbLL * oL + fbRL * oR;
+        dst[1] = inR[k] + fbLR * oL + fbRR * oR;
+        outL[k] = oL;
+        outR[k] = oR;
+        w = (w + 1) & mask;
+    }
+
+    self->wp = w;
+}
+
+} // extern "C"
+
+static void
+destroy(const Methcla_World* world, Methcla_Synth* synth)
+{
+    Synth* self = (Synth*)synth;
+    nrtbuffer_cancel(self->request);
+    nrtbuffer_free(world, self->buffer);
+}
+
+static const Methcla_SynthDef descriptor =
+{
+    METHCLA_PLUGINS_STEREODELAY_URI,
+    sizeof(Synth),
+    sizeof(Options),
+    configure,
+    port_descriptor,
+    construct,
+    connect,
+    NULL,
+    process,
+    destroy
+};
+
+static const Methcla_Library library = { NULL, NULL };
+
+METHCLA_EXPORT const Methcla_Library* methcla_plugins_stereodelay(const Methcla_Host* host, const char* /* bundlePath */)
+{
+    methcla_host_register_synthdef(host, &descriptor);
+    return &library;
+}